@@ -27,14 +27,22 @@
 #include <Arduino.h>
 #include <WiFi.h>
 #include "esp_camera.h"
+#include "img_converters.h"
 #include "SD_MMC.h"
 #include "FS.h"
 
 #include <esp_wifi.h>
+#include "esp_timer.h"
+#include "nvs.h"
+#include "esp_log.h"
 extern "C" {
   #include "esp_http_server.h"
   #include "esp_wpa2.h"
 }
+#include "lwip/sockets.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <cstdarg>
 
@@ -43,6 +51,14 @@ static void sse_send_line(httpd_req_t *req, const char* s);
 static void sse_send_recent(httpd_req_t *req, int max_lines);
 static void set_stream_mode();
 static void set_capture_mode();
+static esp_err_t udp_push_handler(httpd_req_t *req);
+static camera_fb_t* cam_fb_get();
+static void cam_fb_return(camera_fb_t* fb);
+struct CaptureFrame;
+static CaptureFrame* capture_frame(const char* source, uint8_t sinks, bool prepared);
+static void capture_dispatch(CaptureFrame* c);
+static void capture_release(CaptureFrame* c);
+static void capture_http_done(CaptureFrame* c, bool sent);
 
 // ============================ CONFIG ============================
 
@@ -57,6 +73,10 @@ static const char* WIFI_ENT_IDENT = "";
 
 static const char* DEVICE_NAME = "Joint_CM_2026 v2.2 EyeTrack";
 
+// UDP frame push target (IPv4). Empty host = disabled until set via /udp/push
+static const char* UDP_PUSH_HOST = "";
+static const uint16_t UDP_PUSH_PORT = 5005;
+
 // Hardware pins
 static const int FLASH_LED_PIN = 4;
 static const int BUTTON_PIN = 12;
@@ -67,12 +87,90 @@ static const uint32_t LONG_PRESS_MS = 800;
 
 // ============================ PERFORMANCE CONFIG ============================
 
-#define STREAM_FRAMESIZE  FRAMESIZE_QVGA
-#define CAPTURE_FRAMESIZE FRAMESIZE_VGA
-#define STREAM_QUALITY  12
-#define CAPTURE_QUALITY 8
-#define TARGET_STREAM_FPS 20
-#define MIN_FRAME_TIME_MS (1000 / TARGET_STREAM_FPS)
+// Compile-time defaults. Live values come from the config registry below and
+// can be changed per device through /config (persisted in NVS).
+#define DEFAULT_STREAM_FRAMESIZE  FRAMESIZE_QVGA
+#define DEFAULT_CAPTURE_FRAMESIZE FRAMESIZE_VGA
+#define DEFAULT_STREAM_QUALITY  12
+#define DEFAULT_CAPTURE_QUALITY 8
+#define DEFAULT_TARGET_STREAM_FPS 20
+#define DEFAULT_FB_COUNT 3
+#define DEFAULT_XCLK_MHZ 20
+#define DEFAULT_LOG_CAP 320
+#define DEFAULT_HTTPD_STACK 8192
+#define DEFAULT_TARGET_KB 0            // 0 = fixed JPEG quality, no auto-tuning
+#define DEFAULT_CAM_PROFILE 0          // 0 = custom: fb_count / fb_psram / grab_latest
+#define DEFAULT_FB_PSRAM 1
+#define DEFAULT_GRAB_LATEST 1
+
+// ============================ CONFIG REGISTRY ============================
+// CFG_HOT params take effect immediately; CFG_REBOOT params are persisted and
+// picked up at the next boot. `value` is what the firmware is running with,
+// `stored` is what NVS holds (they differ only while a reboot is pending).
+enum CfgApply : uint8_t { CFG_HOT, CFG_REBOOT };
+
+enum CfgId {
+  CFG_STREAM_FRAMESIZE,
+  CFG_CAPTURE_FRAMESIZE,
+  CFG_STREAM_QUALITY,
+  CFG_CAPTURE_QUALITY,
+  CFG_TARGET_STREAM_FPS,
+  CFG_FB_COUNT,
+  CFG_XCLK_MHZ,
+  CFG_LOG_CAP,
+  CFG_HTTPD_STACK,
+  CFG_STREAM_TARGET_KB,
+  CFG_CAPTURE_TARGET_KB,
+  CFG_RECORD_TARGET_KB,
+  CFG_CAM_PROFILE,
+  CFG_FB_PSRAM,
+  CFG_GRAB_LATEST,
+  CFG_COUNT
+};
+
+struct CfgParam {
+  const char* key;          // NVS key and /config name, max 15 chars
+  int32_t def;
+  int32_t min;
+  int32_t max;
+  CfgApply apply;
+  int32_t value;
+  int32_t stored;
+};
+
+static CfgParam g_cfg[CFG_COUNT] = {
+  {"stream_fs",   DEFAULT_STREAM_FRAMESIZE,  FRAMESIZE_96X96, FRAMESIZE_UXGA, CFG_HOT,    0, 0},
+  {"capture_fs",  DEFAULT_CAPTURE_FRAMESIZE, FRAMESIZE_96X96, FRAMESIZE_UXGA, CFG_HOT,    0, 0},
+  {"stream_q",    DEFAULT_STREAM_QUALITY,    4,     63,     CFG_HOT,    0, 0},
+  {"capture_q",   DEFAULT_CAPTURE_QUALITY,   4,     63,     CFG_HOT,    0, 0},
+  {"stream_fps",  DEFAULT_TARGET_STREAM_FPS, 1,     60,     CFG_HOT,    0, 0},
+  {"fb_count",    DEFAULT_FB_COUNT,          1,     4,      CFG_REBOOT, 0, 0},
+  {"xclk_mhz",    DEFAULT_XCLK_MHZ,          8,     20,     CFG_HOT,    0, 0},
+  {"log_cap",     DEFAULT_LOG_CAP,           32,    2048,   CFG_REBOOT, 0, 0},
+  {"httpd_stack", DEFAULT_HTTPD_STACK,       4096,  32768,  CFG_REBOOT, 0, 0},
+  {"stream_kb",   DEFAULT_TARGET_KB,         0,     200,    CFG_HOT,    0, 0},
+  {"capture_kb",  DEFAULT_TARGET_KB,         0,     200,    CFG_HOT,    0, 0},
+  {"record_kb",   DEFAULT_TARGET_KB,         0,     200,    CFG_HOT,    0, 0},
+  {"cam_profile", DEFAULT_CAM_PROFILE,       0,     3,      CFG_REBOOT, 0, 0},
+  {"fb_psram",    DEFAULT_FB_PSRAM,          0,     1,      CFG_REBOOT, 0, 0},
+  {"grab_latest", DEFAULT_GRAB_LATEST,       0,     1,      CFG_REBOOT, 0, 0},
+};
+
+static const char* CFG_NVS_NAMESPACE = "perf";
+static framesize_t g_cam_init_framesize = FRAMESIZE_INVALID;  // JPEG buffers are sized for this
+
+#define CFG(id) (g_cfg[id].value)
+
+#define STREAM_FRAMESIZE  ((framesize_t)CFG(CFG_STREAM_FRAMESIZE))
+#define CAPTURE_FRAMESIZE ((framesize_t)CFG(CFG_CAPTURE_FRAMESIZE))
+#define STREAM_QUALITY    CFG(CFG_STREAM_QUALITY)
+#define CAPTURE_QUALITY   CFG(CFG_CAPTURE_QUALITY)
+#define TARGET_STREAM_FPS CFG(CFG_TARGET_STREAM_FPS)
+#define MIN_FRAME_TIME_MS ((uint32_t)(1000 / TARGET_STREAM_FPS))
+
+// Stream ROI coordinates are in full-sensor (OV2640 UXGA) pixels
+#define SENSOR_FULL_W 1600
+#define SENSOR_FULL_H 1200
 
 // ============================ CAMERA PINS (AI Thinker) ============================
 #define PWDN_GPIO_NUM     32
@@ -93,16 +191,16 @@ static const uint32_t LONG_PRESS_MS = 800;
 #define PCLK_GPIO_NUM     22
 
 // ============================ LOG BUFFER ============================
-static const int LOG_CAP = 320;
 static const int LOG_LEN = 220;
 
-static char g_log[LOG_CAP][LOG_LEN];
+// Allocated at boot from CFG_LOG_CAP (PSRAM when available)
+static int g_log_cap = 0;
+static char (*g_log)[LOG_LEN] = nullptr;
 static volatile uint32_t g_log_seq = 0;
 static volatile int g_log_head = 0;
 static portMUX_TYPE g_log_mux = portMUX_INITIALIZER_UNLOCKED;
 
 static uint32_t g_boot_ms = 0;
-static uint32_t g_last_status_ms = 0;
 
 static httpd_handle_t g_httpd = nullptr;
 
@@ -110,8 +208,75 @@ static httpd_handle_t g_httpd = nullptr;
 static volatile bool g_button_pressed = false;
 static volatile uint32_t g_button_press_time = 0;
 static volatile uint32_t g_button_release_time = 0;
-static volatile bool g_button_event_pending = false;
-static volatile bool g_is_long_press = false;
+
+// Button edges are pushed from the ISR straight to the input task as
+// notification bits; nothing polls for them.
+enum : uint32_t {
+  BTN_EV_PRESS = 1 << 0,
+  BTN_EV_SHORT = 1 << 1,
+  BTN_EV_LONG  = 1 << 2,
+};
+static TaskHandle_t g_input_task = nullptr;
+static volatile bool g_still_capture = false;   // recording skips frames while set
+
+// ============================ EVENT LOOP STATE ============================
+// loop() sleeps on this group until something happens: the periodic status
+// timer, the recorder asking for its next frame, or a record start/stop
+// request. Recording is only ever touched from loop(), so starting or
+// stopping can't race a frame write.
+enum : EventBits_t {
+  EV_STATUS     = 1 << 0,
+  EV_RECORD     = 1 << 1,
+  EV_REC_TOGGLE = 1 << 2,
+  EV_ALL        = EV_STATUS | EV_RECORD | EV_REC_TOGGLE,
+};
+static const uint32_t STATUS_PERIOD_MS = 5000;
+static EventGroupHandle_t g_main_events = nullptr;
+static esp_timer_handle_t g_status_timer = nullptr;
+
+static void main_event(EventBits_t bits) {
+  if (g_main_events) xEventGroupSetBits(g_main_events, bits);
+}
+
+static void status_timer_cb(void* arg) {
+  main_event(EV_STATUS);
+}
+
+// ============================ LED STATE ============================
+// The flash LED runs on LEDC PWM. Feedback cues are step patterns played by
+// an esp_timer callback, so callers never wait on a blink; when a pattern
+// ends the LED returns to the steady level set by set_flash().
+// Channel 2 uses LEDC timer 1; timer 0 drives the camera XCLK.
+static const uint8_t FLASH_LEDC_CHANNEL = 2;
+static const uint32_t FLASH_LEDC_FREQ = 5000;
+
+struct LedStep {
+  uint8_t level;      // 0..255 duty
+  uint16_t ms;
+};
+
+struct LedPattern {
+  const LedStep* steps;
+  uint8_t count;
+};
+
+static const LedStep LED_STEPS_PHOTO[]     = {{255, 100}};
+static const LedStep LED_STEPS_EYE[]       = {{255, 50}};
+static const LedStep LED_STEPS_REC_START[] = {{255, 50}};
+static const LedStep LED_STEPS_REC_STOP[]  = {{255, 100}, {0, 100}, {255, 100}};
+
+#define LED_PATTERN(steps) LedPattern{steps, sizeof(steps) / sizeof(steps[0])}
+static const LedPattern LED_PHOTO     = LED_PATTERN(LED_STEPS_PHOTO);
+static const LedPattern LED_EYE       = LED_PATTERN(LED_STEPS_EYE);
+static const LedPattern LED_REC_START = LED_PATTERN(LED_STEPS_REC_START);
+static const LedPattern LED_REC_STOP  = LED_PATTERN(LED_STEPS_REC_STOP);
+
+static esp_timer_handle_t g_led_timer = nullptr;
+static portMUX_TYPE g_led_mux = portMUX_INITIALIZER_UNLOCKED;
+static const LedStep* g_led_steps = nullptr;  // pattern playing, null when idle
+static uint8_t g_led_count = 0;
+static uint8_t g_led_step = 0;
+static uint8_t g_led_base = 0;                // steady level between patterns
 
 // ============================ RECORDING STATE ============================
 static volatile bool g_is_recording = false;
@@ -119,6 +284,183 @@ static volatile uint32_t g_recording_start_ms = 0;
 static char g_current_video_path[64] = {0};
 static File g_video_file;
 static uint32_t g_video_frame_count = 0;
+static int64_t g_video_first_ts_us = 0;
+
+// Each recorded frame is a multipart part carrying its length and capture
+// time (ms since the first frame) so playback can frame and pace it without
+// scanning. Files from older firmware have neither header.
+static const char* VIDEO_PART_FMT =
+  "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %u\r\n\r\n";
+
+struct MjpegReader {
+  File file;
+  uint8_t* buf;         // read-ahead window, bounded to ~2 frames
+  size_t cap;
+  size_t pos;           // start of unparsed data
+  size_t end;           // end of valid data
+  bool eof;
+  uint32_t frames;
+};
+
+static const float PLAYBACK_LEGACY_FPS = 10.0f;
+static const uint32_t PLAYBACK_MAX_LAG_MS = 500;
+
+// ============================ STREAM VIEW STATE ============================
+// Region of interest + downscale applied through the OV2640 DSP window
+// (set_res_raw), so the sensor encodes only the requested pixels. The window
+// changes what every consumer of the sensor gets, so a view is only granted
+// while its client is the sole live consumer, and other live consumers are
+// turned away until it ends (see stream_view_conflict()).
+struct StreamView {
+  bool active;
+  uint16_t x, y, w, h;      // ROI, full-sensor pixels
+  uint8_t scale_div;        // output = ROI / scale_div
+  uint8_t mode;             // OV2640 sensor mode: 0 UXGA, 1 SVGA, 2 CIF
+  uint16_t win_x, win_y;    // DSP window in sensor-mode pixels
+  uint16_t win_w, win_h;
+  uint16_t out_w, out_h;    // encoded JPEG size
+};
+
+static StreamView g_stream_view = {};
+
+// ============================ FRAME BUFFER STATE ============================
+// Buffer pool presets selected by cam_profile (applied at camera init).
+// "record" and "burst" queue frames in order so no exposure is lost;
+// "stream" keeps only the newest.
+struct CamProfile {
+  const char* name;
+  uint8_t fb_count;
+  bool psram;
+  bool grab_latest;
+};
+
+static const CamProfile CAM_PROFILES[] = {
+  {"custom", 0, false, false},  // taken from fb_count / fb_psram / grab_latest
+  {"stream", 2, true,  true},
+  {"record", 3, true,  false},
+  {"burst",  4, true,  false},
+};
+
+static CamProfile g_cam_pool = {};  // what the driver was actually initialised with
+
+// Buffer usage telemetry, fed by cam_fb_get()/cam_fb_return() and by a hook on
+// the driver's log output for overflow warnings it does not otherwise expose.
+struct CamStats {
+  uint32_t frames;
+  uint32_t get_fail;
+  uint32_t skipped;         // sensor frames no consumer received (timestamp gaps)
+  uint32_t truncated;       // JPEG without EOI
+  uint32_t held;            // buffers currently out with consumers
+  uint32_t held_max;
+  uint64_t hold_us_total;
+  uint32_t hold_us_max;
+  uint64_t wait_us_total;
+  uint32_t wait_us_max;
+  uint32_t min_interval_us;
+  size_t max_len;
+};
+
+static const int CAM_HELD_SLOTS = 4;
+
+static CamStats g_cam_stats = {};
+static portMUX_TYPE g_cam_stats_mux = portMUX_INITIALIZER_UNLOCKED;
+static struct { camera_fb_t* fb; int64_t since_us; } g_cam_held[CAM_HELD_SLOTS];
+static int64_t g_cam_last_ts_us = 0;
+static volatile uint32_t g_cam_ovf = 0;      // driver FB-OVF / EOF / VSYNC overflow
+static volatile uint32_t g_cam_no_eoi = 0;   // driver NO-SOI / NO-EOI
+static vprintf_like_t g_prev_vprintf = nullptr;
+
+// ============================ SNAPSHOT CACHE STATE ============================
+// Latest stream-resolution JPEG, copied from frames the stream consumers are
+// already pulling while snapshot pollers are around, so /capture?snapshot=1
+// costs no extra sensor work and never switches modes.
+struct SnapshotCache {
+  uint8_t* buf;
+  size_t cap;
+  size_t len;
+  uint32_t seq;           // bumps per cached frame; ETag with g_snap_boot_id
+  int64_t ts_us;          // fb->timestamp of the cached frame
+  uint32_t captured_ms;   // same instant on the millis() clock
+};
+
+static const uint32_t SNAP_ACTIVE_MS = 10000;   // keep copying this long after a poll
+static const uint32_t SNAP_DEFAULT_MAX_AGE_MS = 1000;
+static SnapshotCache g_snap = {};
+static SemaphoreHandle_t g_snap_lock = nullptr;
+static volatile uint32_t g_snap_last_req_ms = 0;
+static uint32_t g_snap_boot_id = 0;            // ETag prefix, so counters from a previous boot never match
+static uint32_t g_snap_hits = 0;
+static uint32_t g_snap_misses = 0;
+
+// ============================ CAPTURE PIPELINE STATE ============================
+// One exposure, many consumers. A still is copied out of the driver buffer
+// once, the sensor goes straight back to stream mode, and every requested
+// sink works from that copy: the HTTP response on the requesting task, the
+// rest on the capture task. Each holder owns a reference; the last release
+// frees the copy.
+enum : uint8_t {
+  SINK_HTTP    = 1 << 0,  // JPEG in the /capture response
+  SINK_SD      = 1 << 1,  // /photos/IMG_nnnn.jpg
+  SINK_THUMB   = 1 << 2,  // /thumbs/IMG_nnnn.jpg, decoded at 1/2..1/8 scale
+  SINK_JOURNAL = 1 << 3,  // one CSV line in CAP_JOURNAL_PATH
+  SINK_NOTIFY  = 1 << 4,  // WS_MSG_CAPTURED to control clients
+};
+
+struct CaptureFrame {
+  uint8_t* buf;
+  size_t len;
+  uint16_t width;
+  uint16_t height;
+  uint32_t seq;
+  uint32_t captured_ms;
+  const char* source;     // "http", "btn"
+  uint8_t sinks;          // requested
+  uint8_t done;           // completed successfully
+  char path[32];          // SD name, reserved at capture so the HTTP reply can report it
+  uint8_t pending;        // HTTP send / SD work still running before journal + notify
+  uint32_t refs;
+};
+
+#define CAP_JOURNAL_PATH "/captures.csv"
+static const uint8_t BTN_SINKS = SINK_SD | SINK_THUMB | SINK_JOURNAL | SINK_NOTIFY;
+static const uint8_t SINKS_NEED_SD = SINK_SD | SINK_THUMB | SINK_JOURNAL;
+static const int CAP_QUEUE_LEN = 4;
+static const uint16_t THUMB_MAX_W = 200;
+static const uint8_t THUMB_QUALITY = 70;
+
+static QueueHandle_t g_cap_queue = nullptr;
+static portMUX_TYPE g_cap_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t g_cap_seq = 0;
+
+// ============================ AUTO QUALITY STATE ============================
+// Per-profile JPEG quality controller holding fb->len near a byte budget.
+// Only the profile currently driving the sensor adapts; samples from other
+// profiles (e.g. a stream frame grabbed mid-capture) are ignored.
+enum AqProfile { AQ_STREAM, AQ_CAPTURE, AQ_RECORD, AQ_COUNT };
+
+struct AutoQuality {
+  CfgId target_cfg;         // budget in KB, 0 = use base quality unchanged
+  CfgId base_cfg;           // fixed quality and starting point
+  int quality;              // current sensor quality while auto-tuning, 0 = not started
+  float avg_len;            // smoothed frame size
+  uint8_t settle;           // frames to ignore after a quality change
+};
+
+static const int AQ_Q_MIN = 4;
+static const int AQ_Q_MAX = 50;
+static const int AQ_MAX_STEP = 4;
+static const float AQ_STEPS_PER_DOUBLING = 6.0f;  // ~quality steps that halve JPEG size
+static const float AQ_DEADBAND = 0.1f;
+static const uint8_t AQ_SETTLE_FRAMES = 2;
+
+static AutoQuality g_aq[AQ_COUNT] = {
+  {CFG_STREAM_TARGET_KB,  CFG_STREAM_QUALITY,  0, 0, 0},
+  {CFG_CAPTURE_TARGET_KB, CFG_CAPTURE_QUALITY, 0, 0, 0},
+  {CFG_RECORD_TARGET_KB,  CFG_STREAM_QUALITY,  0, 0, 0},
+};
+static volatile AqProfile g_aq_active = AQ_STREAM;
+
+static void aq_observe(AqProfile p, size_t len);
 
 // ============================ SD CARD STATE ============================
 static bool g_sd_available = false;
@@ -126,13 +468,193 @@ static uint32_t g_photo_counter = 0;
 static uint32_t g_video_counter = 0;
 static uint32_t g_eyetrack_counter = 0;
 
+// Downloads read the card in large blocks on a helper task while the httpd
+// task sends the previous block straight out of the same buffer.
+#define SD_MOUNT_POINT "/sdcard"
+static const size_t SD_DL_BLOCK = 16 * 1024;
+static const int SD_DL_BUFFERS = 2;
+
+struct SdDlBlock {
+  uint8_t* buf;
+  int len;              // bytes read, 0 at end of file, <0 on read error
+};
+
+struct SdDownload {
+  int fd;
+  SdDlBlock blocks[SD_DL_BUFFERS];
+  QueueHandle_t free_q; // indices of blocks ready to be filled
+  QueueHandle_t full_q; // indices of blocks ready to be sent
+  volatile bool abort;
+  TaskHandle_t owner;
+};
+
 // ============================ EYE TRACKING STATS ============================
 static uint32_t g_eyetrack_captures = 0;
 static uint32_t g_eyetrack_triggers = 0;
 
+// ============================ WEBSOCKET STATE ============================
+// Binary control channel on /ws. Every message starts with a one-byte opcode;
+// the same opcode is used for a request and its reply.
+enum : uint8_t {
+  WS_MSG_TRIGGER = 0x01,  // C->S: [op]           S->C: [op][ok][pad x2][total u32][filename | error]
+  WS_MSG_FLASH   = 0x02,  // C->S: [op][on]       S->C: [op][on]
+  WS_MSG_STATUS  = 0x03,  // C->S: [op]           S->C: [op] + WsStatusMsg
+  WS_MSG_LOG     = 0x04,  // S->C: [op][utf8 line]
+  WS_MSG_CAPTURED = 0x05, // S->C: [op][sinks done][pad x2][seq u32][bytes u32][path]
+  WS_MSG_PING    = 0x06,  // C->S: [op][pad x3][token u32]  S->C: same bytes echoed
+  WS_MSG_CREDIT  = 0x10,  // C->S on /ws/stream: [op][frames u8]
+  WS_MSG_FRAME   = 0x11,  // S->C on /ws/stream: WsFrameHeader + JPEG
+};
+
+struct __attribute__((packed)) WsStatusMsg {
+  uint8_t  op;
+  uint8_t  flags;         // bit0 wifi, bit1 sd, bit2 recording
+  int8_t   rssi;
+  uint8_t  reserved;
+  uint32_t uptime_s;
+  uint32_t heap;
+  uint32_t triggers;
+  uint32_t captures;
+  uint32_t sd_used_mb;
+  uint32_t sd_total_mb;
+  uint32_t sd_rev;
+};
+
+struct __attribute__((packed)) WsFrameHeader {
+  uint8_t  op;
+  uint8_t  reserved[3];
+  uint32_t seq;           // increments per captured frame; gaps mean skipped frames
+  uint32_t ts_ms;         // capture time from fb->timestamp
+  uint32_t len;           // JPEG bytes following the header
+};
+
+struct WsClient {
+  int fd;
+  uint32_t log_seq;       // next log line this client has not seen
+};
+
+// Video clients only receive a frame while they hold credit; the browser grants
+// one credit back per decoded frame, so frames never queue up in the socket.
+struct WsStreamClient {
+  int fd;
+  uint8_t credits;
+};
+
+static const int WS_MAX_CLIENTS = 4;
+static const int WS_RX_MAX = 32;
+static const int WS_BACKLOG_LINES = 50;
+static const uint32_t WS_STATUS_PUSH_MS = 2000;
+static const uint32_t WS_SD_REFRESH_MS = 15000;
+
+static WsClient g_ws_clients[WS_MAX_CLIENTS];
+static volatile int g_ws_client_count = 0;
+static portMUX_TYPE g_ws_mux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t g_ws_send_lock = nullptr;
+static TaskHandle_t g_ws_task = nullptr;
+
+static const int WSS_MAX_CLIENTS = 2;
+static const uint8_t WSS_MAX_CREDITS = 4;
+
+static WsStreamClient g_wss_clients[WSS_MAX_CLIENTS];
+static volatile int g_wss_client_count = 0;
+static TaskHandle_t g_wss_task = nullptr;
+
+// Bumped whenever a file is created or removed so clients know to re-list.
+static volatile uint32_t g_sd_rev = 0;
+static uint32_t g_sd_used_mb = 0;
+static uint32_t g_sd_total_mb = 0;
+
+// ============================ RTSP STATE ============================
+// RTSP control on TCP 554; RTP/JPEG (RFC 2435) either to the client's UDP port
+// from RTP_SERVER_PORT or interleaved on the RTSP socket.
+static const uint16_t RTSP_PORT = 554;
+static const uint16_t RTP_SERVER_PORT = 6970;
+static const int RTSP_MAX_SESSIONS = 4;
+static const int RTSP_RX_BUF = 1024;
+static const int RTP_MAX_PAYLOAD = 1400;
+static const uint32_t RTSP_SESSION_TIMEOUT_MS = 60000;
+static const uint32_t RTSP_STATS_MS = 5000;
+
+struct RtspSession {
+  int fd;                   // RTSP control socket, -1 when the slot is free
+  uint32_t id;
+  bool setup;
+  bool playing;
+  bool tcp;                 // RTP interleaved on the control socket
+  uint8_t channel;          // interleaved RTP channel
+  sockaddr_in rtp_addr;     // UDP destination
+  uint32_t last_rx_ms;
+  bool frame_dropped;       // stop sending the rest of a frame after a send error
+  uint32_t pkts, bytes, frames, drops;
+  uint32_t stats_ms;
+  uint16_t rx_len;
+  char rx[RTSP_RX_BUF];
+};
+
+// Parsed view into a camera JPEG, as needed for RFC 2435 packetization.
+struct JpegInfo {
+  const uint8_t* qt[2];     // 8-bit luma/chroma quantization tables (zig-zag order)
+  const uint8_t* scan;      // entropy-coded data after SOS, without EOI
+  size_t scan_len;
+  uint16_t width;
+  uint16_t height;
+  uint16_t dri;
+  uint8_t type;             // 0 = 4:2:2, 1 = 4:2:0
+};
+
+static RtspSession g_rtsp[RTSP_MAX_SESSIONS];
+static int g_rtsp_listen_fd = -1;
+static int g_rtp_udp_fd = -1;
+static uint16_t g_rtp_seq = 0;
+static uint32_t g_rtp_ssrc = 0;
+
+// ============================ UDP PUSH STATE ============================
+// Each JPEG is split into datagrams of at most UDP_PUSH_PAYLOAD bytes, each
+// prefixed with UdpFragHeader (network byte order). Nothing is retransmitted;
+// the receiver drops frames that do not complete. See tools/udp_receiver.
+static const int UDP_PUSH_PAYLOAD = 1400;
+static const uint16_t UDP_FRAG_MAGIC = 0x4A43;  // "JC"
+static const uint8_t UDP_FRAG_VERSION = 1;
+
+struct __attribute__((packed)) UdpFragHeader {
+  uint16_t magic;
+  uint8_t  version;
+  uint8_t  flags;
+  uint32_t frame_seq;
+  uint32_t frame_len;
+  uint32_t frag_offset;
+  uint32_t capture_us;    // fb->timestamp, device esp_timer clock
+  uint32_t send_us;       // same clock, when the first fragment went out
+  uint16_t frag_index;
+  uint16_t frag_count;
+};
+
+static int g_udp_push_fd = -1;
+static sockaddr_in g_udp_push_addr;
+static volatile bool g_udp_push_enabled = false;
+static portMUX_TYPE g_udp_push_mux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t g_udp_push_task = nullptr;
+static uint32_t g_udp_push_frames = 0;
+static uint32_t g_udp_push_dropped = 0;
+
 // ============================ HELPERS ============================
 static bool has_text(const char* s) { return s && s[0] != '\0'; }
 
+// In-place %XX decoding of a query value; httpd_query_key_value() leaves it encoded.
+static void url_decode(char* s) {
+  char* out = s;
+  for (; *s; s++) {
+    if (s[0] == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+      char hex[3] = {s[1], s[2], 0};
+      *out++ = (char)strtol(hex, NULL, 16);
+      s += 2;
+    } else {
+      *out++ = *s;
+    }
+  }
+  *out = '\0';
+}
+
 static const char* reset_reason_str(esp_reset_reason_t r) {
   switch (r) {
     case ESP_RST_POWERON:   return "POWERON";
@@ -149,11 +671,21 @@ static const char* reset_reason_str(esp_reset_reason_t r) {
   }
 }
 
+static void log_init() {
+  g_log_cap = CFG(CFG_LOG_CAP);
+  size_t bytes = (size_t)g_log_cap * LOG_LEN;
+  g_log = (char (*)[LOG_LEN])(psramFound() ? ps_malloc(bytes) : malloc(bytes));
+  if (!g_log) {
+    g_log_cap = 32;
+    g_log = (char (*)[LOG_LEN])malloc((size_t)g_log_cap * LOG_LEN);
+  }
+}
+
 static void log_clear() {
   portENTER_CRITICAL(&g_log_mux);
   g_log_seq = 0;
   g_log_head = 0;
-  for (int i = 0; i < LOG_CAP; i++) g_log[i][0] = '\0';
+  for (int i = 0; i < g_log_cap; i++) g_log[i][0] = '\0';
   portEXIT_CRITICAL(&g_log_mux);
 }
 
@@ -165,23 +697,98 @@ static void log_pushf(const char* fmt, ...) {
   va_end(args);
 
   Serial.println(line);
+  if (!g_log) return;
 
   portENTER_CRITICAL(&g_log_mux);
   strncpy(g_log[g_log_head], line, LOG_LEN - 1);
   g_log[g_log_head][LOG_LEN - 1] = '\0';
-  g_log_head = (g_log_head + 1) % LOG_CAP;
+  g_log_head = (g_log_head + 1) % g_log_cap;
   g_log_seq++;
   portEXIT_CRITICAL(&g_log_mux);
+
+  if (g_ws_task && g_ws_client_count > 0) xTaskNotifyGive(g_ws_task);
+}
+
+// Copies the line with sequence number `seq` if it is still in the ring.
+static bool log_read(uint32_t seq, char* out, size_t out_len) {
+  bool ok = false;
+  portENTER_CRITICAL(&g_log_mux);
+  uint32_t newest = g_log_seq;
+  if (seq < newest && newest - seq <= (uint32_t)g_log_cap) {
+    int idx = (g_log_head - (int)(newest - seq) + g_log_cap) % g_log_cap;
+    strncpy(out, g_log[idx], out_len - 1);
+    out[out_len - 1] = '\0';
+    ok = true;
+  }
+  portEXIT_CRITICAL(&g_log_mux);
+  return ok;
+}
+
+static void led_timer_cb(void* arg) {
+  uint8_t level;
+  uint16_t ms = 0;
+  
+  portENTER_CRITICAL(&g_led_mux);
+  if (g_led_steps && ++g_led_step < g_led_count) {
+    level = g_led_steps[g_led_step].level;
+    ms = g_led_steps[g_led_step].ms;
+  } else {
+    g_led_steps = nullptr;
+    level = g_led_base;
+  }
+  portEXIT_CRITICAL(&g_led_mux);
+  
+  ledcWrite(FLASH_LEDC_CHANNEL, level);
+  if (ms) esp_timer_start_once(g_led_timer, ms * 1000ULL);
+}
+
+static void led_init() {
+  ledcSetup(FLASH_LEDC_CHANNEL, FLASH_LEDC_FREQ, 8);
+  ledcAttachPin(FLASH_LED_PIN, FLASH_LEDC_CHANNEL);
+  ledcWrite(FLASH_LEDC_CHANNEL, 0);
+  
+  esp_timer_create_args_t args = {};
+  args.callback = led_timer_cb;
+  args.name = "led";
+  esp_timer_create(&args, &g_led_timer);
+}
+
+// Starts a feedback pattern, replacing any that is still playing.
+static void led_play(const LedPattern& p) {
+  if (!g_led_timer || p.count == 0) return;
+  esp_timer_stop(g_led_timer);
+  
+  portENTER_CRITICAL(&g_led_mux);
+  g_led_steps = p.steps;
+  g_led_count = p.count;
+  g_led_step = 0;
+  portEXIT_CRITICAL(&g_led_mux);
+  
+  ledcWrite(FLASH_LEDC_CHANNEL, p.steps[0].level);
+  // The callback may have re-armed the timer between stop and here
+  if (esp_timer_start_once(g_led_timer, p.steps[0].ms * 1000ULL) != ESP_OK) {
+    esp_timer_stop(g_led_timer);
+    esp_timer_start_once(g_led_timer, p.steps[0].ms * 1000ULL);
+  }
+}
+
+static void set_flash_level(uint8_t level) {
+  bool idle;
+  portENTER_CRITICAL(&g_led_mux);
+  g_led_base = level;
+  idle = !g_led_steps;
+  portEXIT_CRITICAL(&g_led_mux);
+  if (idle) ledcWrite(FLASH_LEDC_CHANNEL, level);
 }
 
 static void set_flash(bool on) {
-  digitalWrite(FLASH_LED_PIN, on ? HIGH : LOW);
+  set_flash_level(on ? 255 : 0);
 }
 
 // ============================ SD CARD FUNCTIONS ============================
 
 static bool init_sd_card() {
-  if (!SD_MMC.begin("/sdcard", true)) {
+  if (!SD_MMC.begin(SD_MOUNT_POINT, true)) {
     log_pushf("[sd] mount failed");
     return false;
   }
@@ -206,6 +813,7 @@ static bool init_sd_card() {
   if (!SD_MMC.exists("/photos")) SD_MMC.mkdir("/photos");
   if (!SD_MMC.exists("/videos")) SD_MMC.mkdir("/videos");
   if (!SD_MMC.exists("/eyetrack")) SD_MMC.mkdir("/eyetrack");
+  if (!SD_MMC.exists("/thumbs")) SD_MMC.mkdir("/thumbs");
   
   // Find highest existing file numbers
   File root = SD_MMC.open("/photos");
@@ -252,28 +860,6 @@ static bool init_sd_card() {
   return true;
 }
 
-static bool save_photo_to_sd(camera_fb_t* fb, char* out_filename, size_t out_len) {
-  if (!g_sd_available || !fb) return false;
-  
-  snprintf(out_filename, out_len, "/photos/IMG_%04u.jpg", g_photo_counter++);
-  
-  File file = SD_MMC.open(out_filename, FILE_WRITE);
-  if (!file) {
-    log_pushf("[sd] create failed: %s", out_filename);
-    return false;
-  }
-  
-  size_t written = file.write(fb->buf, fb->len);
-  file.close();
-  
-  if (written != fb->len) {
-    log_pushf("[sd] write error: %u/%u", written, fb->len);
-    return false;
-  }
-  
-  return true;
-}
-
 // New function for eye-track captures
 static bool save_eyetrack_photo(camera_fb_t* fb, char* out_filename, size_t out_len) {
   if (!g_sd_available || !fb) return false;
@@ -288,6 +874,7 @@ static bool save_eyetrack_photo(camera_fb_t* fb, char* out_filename, size_t out_
   
   size_t written = file.write(fb->buf, fb->len);
   file.close();
+  g_sd_rev++;
   
   if (written != fb->len) {
     log_pushf("[eye] write error: %u/%u", written, fb->len);
@@ -299,6 +886,10 @@ static bool save_eyetrack_photo(camera_fb_t* fb, char* out_filename, size_t out_
 
 static bool start_video_recording() {
   if (!g_sd_available || g_is_recording) return false;
+  if (g_stream_view.active) {
+    log_pushf("[rec] refused: sensor held by a stream view");
+    return false;
+  }
   
   snprintf(g_current_video_path, sizeof(g_current_video_path), 
            "/videos/VID_%04u.mjpeg", g_video_counter++);
@@ -310,8 +901,12 @@ static bool start_video_recording() {
   }
   
   g_is_recording = true;
+  main_event(EV_RECORD);
   g_recording_start_ms = millis();
   g_video_frame_count = 0;
+  g_video_first_ts_us = 0;
+  g_sd_rev++;
+  set_stream_mode();
   
   log_pushf("[rec] started: %s", g_current_video_path);
   return true;
@@ -320,10 +915,16 @@ static bool start_video_recording() {
 static bool write_video_frame(camera_fb_t* fb) {
   if (!g_is_recording || !g_video_file) return false;
   
-  const char* boundary = "--frame\r\nContent-Type: image/jpeg\r\n\r\n";
-  g_video_file.write((uint8_t*)boundary, strlen(boundary));
+  int64_t ts_us = (int64_t)fb->timestamp.tv_sec * 1000000LL + fb->timestamp.tv_usec;
+  if (g_video_frame_count == 0) g_video_first_ts_us = ts_us;
+  
+  char part[112];
+  size_t hlen = snprintf(part, sizeof(part), VIDEO_PART_FMT, fb->len,
+                         (unsigned)((ts_us - g_video_first_ts_us) / 1000));
+  g_video_file.write((uint8_t*)part, hlen);
   g_video_file.write(fb->buf, fb->len);
   g_video_file.write((uint8_t*)"\r\n", 2);
+  aq_observe(AQ_RECORD, fb->len);
   
   g_video_frame_count++;
   return true;
@@ -334,6 +935,8 @@ static void stop_video_recording() {
   
   g_video_file.close();
   g_is_recording = false;
+  g_sd_rev++;
+  set_stream_mode();
   
   uint32_t duration_ms = millis() - g_recording_start_ms;
   float fps = (duration_ms > 0) ? (g_video_frame_count * 1000.0f / duration_ms) : 0;
@@ -347,73 +950,411 @@ static void stop_video_recording() {
 static void IRAM_ATTR button_isr() {
   uint32_t now = millis();
   bool pressed = (digitalRead(BUTTON_PIN) == LOW);
+  uint32_t ev = 0;
   
   if (pressed && !g_button_pressed) {
     if (now - g_button_release_time > DEBOUNCE_MS) {
       g_button_pressed = true;
       g_button_press_time = now;
+      ev = BTN_EV_PRESS;
     }
   } else if (!pressed && g_button_pressed) {
     if (now - g_button_press_time > DEBOUNCE_MS) {
       g_button_pressed = false;
       g_button_release_time = now;
-      g_is_long_press = (now - g_button_press_time >= LONG_PRESS_MS);
-      g_button_event_pending = true;
+      ev = (now - g_button_press_time >= LONG_PRESS_MS) ? BTN_EV_LONG : BTN_EV_SHORT;
     }
   }
+  
+  if (ev && g_input_task) {
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR(g_input_task, ev, eSetBits, &woken);
+    portYIELD_FROM_ISR(woken);
+  }
+}
+
+// Lets the recorder resume once the sensor is back at stream resolution.
+static void still_capture_done() {
+  g_still_capture = false;
+  if (g_is_recording) main_event(EV_RECORD);
+}
+
+// The sensor is back in stream mode as soon as the frame is copied, so the
+// recorder resumes while the sinks are still writing.
+static void button_photo(bool prepared) {
+  g_still_capture = true;
+  CaptureFrame* c = capture_frame("btn", BTN_SINKS, prepared);
+  uint32_t shutter_ms = millis() - g_button_release_time;
+  still_capture_done();
+  
+  if (c) {
+    log_pushf("[btn] captured #%u (%u bytes, shutter %ums)", c->seq, c->len, shutter_ms);
+    led_play(LED_PHOTO);
+    capture_dispatch(c);
+    capture_release(c);
+  }
 }
 
-static void process_button_events() {
+static void button_record_toggle() {
   if (g_is_recording) {
-    camera_fb_t* fb = esp_camera_fb_get();
-    if (fb) {
+    stop_video_recording();
+    led_play(LED_REC_STOP);
+  } else {
+    if (start_video_recording()) {
+      led_play(LED_REC_START);
+    } else {
+      set_stream_mode();  // undo the press-edge capture preparation
+    }
+  }
+}
+
+// Owns all button actions so they run the moment the ISR fires and never in
+// the recording path. On the press edge the sensor is already switched to
+// capture resolution and the stale frame drained, so a short press only has
+// to grab the next frame. Once the hold reaches LONG_PRESS_MS it can only be
+// a record toggle, so the sensor goes straight back to the live consumers
+// instead of staying at capture size until release.
+static void input_task(void* arg) {
+  bool prepared = false;
+  
+  for (;;) {
+    uint32_t ev = 0;
+    TickType_t wait = portMAX_DELAY;
+    if (prepared) {
+      uint32_t held = millis() - g_button_press_time;
+      wait = held < LONG_PRESS_MS ? pdMS_TO_TICKS(LONG_PRESS_MS - held) : 0;
+    }
+    if (xTaskNotifyWait(0, UINT32_MAX, &ev, wait) != pdTRUE) {
+      set_stream_mode();
+      still_capture_done();
+      prepared = false;
+      continue;
+    }
+    
+    if ((ev & BTN_EV_PRESS) && !g_is_recording) {
+      g_still_capture = true;
+      set_capture_mode();
+      camera_fb_t* fb = cam_fb_get();
+      if (fb) cam_fb_return(fb);
+      prepared = true;
+    }
+    
+    if (ev & BTN_EV_SHORT) {
+      log_pushf("[btn] photo trigger");
+      button_photo(prepared);
+      prepared = false;
+    } else if (ev & BTN_EV_LONG) {
+      main_event(EV_REC_TOGGLE);
+      still_capture_done();
+      prepared = false;
+    }
+  }
+}
+
+// One frame per EV_RECORD. cam_fb_get() blocks until the sensor delivers, so
+// re-arming the event paces recording at the sensor rate while letting other
+// events in between frames. A still capture pauses the chain; it is
+// restarted by still_capture_done().
+static void process_recording() {
+  if (!g_is_recording || g_still_capture) return;
+  
+  camera_fb_t* fb = cam_fb_get();
+  if (fb) {
+    // A still may have switched the sensor while we were blocked in the get;
+    // its frames don't belong in the clip.
+    if (!g_still_capture && fb->width == resolution[STREAM_FRAMESIZE].width &&
+        fb->height == resolution[STREAM_FRAMESIZE].height) {
       write_video_frame(fb);
-      esp_camera_fb_return(fb);
     }
+    cam_fb_return(fb);
   }
+  main_event(EV_RECORD);
+}
+
+// ============================ CAMERA ============================
+
+// Counts the camera driver's overflow warnings on their way to the console.
+static int cam_log_hook(const char* fmt, va_list args) {
+  if (strstr(fmt, "-OVF")) g_cam_ovf++;
+  else if (strstr(fmt, "NO-EOI") || strstr(fmt, "NO-SOI")) g_cam_no_eoi++;
+  return g_prev_vprintf ? g_prev_vprintf(fmt, args) : vprintf(fmt, args);
+}
+
+// Drop the learned sensor frame interval whenever the frame size changes.
+static void cam_stats_mode_changed() {
+  portENTER_CRITICAL(&g_cam_stats_mux);
+  g_cam_stats.min_interval_us = 0;
+  g_cam_last_ts_us = 0;
+  portEXIT_CRITICAL(&g_cam_stats_mux);
+}
+
+// Copies a frame into the snapshot cache. Camera consumers only try the lock,
+// so a slow snapshot download never holds up a stream; that frame is just
+// not cached.
+static bool snapshot_store(const camera_fb_t* fb, TickType_t wait) {
+  if (!g_snap_lock || xSemaphoreTake(g_snap_lock, wait) != pdTRUE) return false;
   
-  if (!g_button_event_pending) return;
-  g_button_event_pending = false;
+  // Already cached (cam_fb_get offered it before the caller got it)
+  int64_t ts_us = (int64_t)fb->timestamp.tv_sec * 1000000LL + fb->timestamp.tv_usec;
+  if (g_snap.len && g_snap.ts_us == ts_us) {
+    xSemaphoreGive(g_snap_lock);
+    return true;
+  }
   
-  if (g_is_long_press) {
-    if (g_is_recording) {
-      stop_video_recording();
-      set_flash(true); delay(100); set_flash(false);
-      delay(100);
-      set_flash(true); delay(100); set_flash(false);
-    } else {
-      if (start_video_recording()) {
-        set_flash(true); delay(50); set_flash(false);
-      }
+  if (fb->len > g_snap.cap) {
+    size_t cap = fb->len + fb->len / 4;
+    uint8_t* buf = (uint8_t*)(psramFound() ? ps_malloc(cap) : malloc(cap));
+    if (!buf) {
+      xSemaphoreGive(g_snap_lock);
+      return false;
     }
+    free(g_snap.buf);
+    g_snap.buf = buf;
+    g_snap.cap = cap;
+  }
+  memcpy(g_snap.buf, fb->buf, fb->len);
+  g_snap.len = fb->len;
+  g_snap.seq++;
+  // The driver stamps frames from esp_timer, which millis() also counts, so
+  // a frame that sat queued in the pool reports its real age.
+  g_snap.ts_us = ts_us;
+  g_snap.captured_ms = ts_us / 1000;
+  
+  xSemaphoreGive(g_snap_lock);
+  return true;
+}
+
+static bool snapshot_offer(const camera_fb_t* fb, TickType_t wait) {
+  if (millis() - g_snap_last_req_ms > SNAP_ACTIVE_MS || g_snap_last_req_ms == 0) return false;
+  // Capture stills and ROI views are not snapshots
+  if (fb->width != resolution[STREAM_FRAMESIZE].width ||
+      fb->height != resolution[STREAM_FRAMESIZE].height) return false;
+  return snapshot_store(fb, wait);
+}
+
+// All frame consumers go through these two so buffer hold times, wait times
+// and skipped sensor frames are measured in one place.
+static camera_fb_t* cam_fb_get() {
+  int64_t t0 = esp_timer_get_time();
+  camera_fb_t* fb = esp_camera_fb_get();
+  int64_t now = esp_timer_get_time();
+  uint32_t wait_us = now - t0;
+  
+  bool eoi = fb && fb->len >= 2 && fb->buf[fb->len - 2] == 0xFF && fb->buf[fb->len - 1] == 0xD9;
+  
+  portENTER_CRITICAL(&g_cam_stats_mux);
+  CamStats& st = g_cam_stats;
+  if (!fb) {
+    st.get_fail++;
   } else {
-    log_pushf("[btn] photo trigger");
-    set_capture_mode();
+    st.frames++;
+    st.wait_us_total += wait_us;
+    if (wait_us > st.wait_us_max) st.wait_us_max = wait_us;
+    if (fb->len > st.max_len) st.max_len = fb->len;
+    if (!eoi) st.truncated++;
     
-    camera_fb_t* fb = esp_camera_fb_get();
-    if (fb) esp_camera_fb_return(fb);
+    for (auto& h : g_cam_held) {
+      if (!h.fb) { h.fb = fb; h.since_us = now; break; }
+    }
+    st.held++;
+    if (st.held > st.held_max) st.held_max = st.held;
     
-    fb = esp_camera_fb_get();
-    if (fb) {
-      char filename[64];
-      if (save_photo_to_sd(fb, filename, sizeof(filename))) {
-        log_pushf("[btn] saved: %s (%u bytes)", filename, fb->len);
-        set_flash(true); delay(100); set_flash(false);
+    // Gaps of several sensor intervals mean frames were overwritten before
+    // anyone asked; gaps over a second are idle time, not loss.
+    int64_t ts = (int64_t)fb->timestamp.tv_sec * 1000000LL + fb->timestamp.tv_usec;
+    if (ts > g_cam_last_ts_us) {
+      if (g_cam_last_ts_us) {
+        uint32_t gap = ts - g_cam_last_ts_us;
+        if (st.min_interval_us == 0 || gap < st.min_interval_us) {
+          st.min_interval_us = gap;
+        } else if (gap < 1000000) {
+          st.skipped += (gap + st.min_interval_us / 2) / st.min_interval_us - 1;
+        }
       }
-      esp_camera_fb_return(fb);
+      g_cam_last_ts_us = ts;
     }
-    
-    set_stream_mode();
   }
+  portEXIT_CRITICAL(&g_cam_stats_mux);
+  
+  if (fb && eoi) snapshot_offer(fb, 0);
+  return fb;
 }
 
-// ============================ CAMERA ============================
+static void cam_fb_return(camera_fb_t* fb) {
+  int64_t now = esp_timer_get_time();
+  
+  portENTER_CRITICAL(&g_cam_stats_mux);
+  for (auto& h : g_cam_held) {
+    if (h.fb == fb) {
+      uint32_t hold_us = now - h.since_us;
+      g_cam_stats.hold_us_total += hold_us;
+      if (hold_us > g_cam_stats.hold_us_max) g_cam_stats.hold_us_max = hold_us;
+      h.fb = nullptr;
+      break;
+    }
+  }
+  if (g_cam_stats.held) g_cam_stats.held--;
+  portEXIT_CRITICAL(&g_cam_stats_mux);
+  
+  esp_camera_fb_return(fb);
+}
+
+// Parses "roi=x,y,w,h" (full-sensor pixels) and "scale=1/N" from a stream query
+// and precomputes the OV2640 window. v->active says whether a view was asked
+// for; returns false if one was but it cannot be honoured.
+static bool parse_stream_view(const char* query, StreamView* v) {
+  char roi[32] = {0};
+  char scale[16] = {0};
+  memset(v, 0, sizeof(*v));
+  esp_err_t roi_err = httpd_query_key_value(query, "roi", roi, sizeof(roi));
+  esp_err_t scale_err = httpd_query_key_value(query, "scale", scale, sizeof(scale));
+  bool has_roi = roi_err != ESP_ERR_NOT_FOUND;
+  bool has_scale = scale_err != ESP_ERR_NOT_FOUND;
+  if (!has_roi && !has_scale) return true;
+  if ((has_roi && roi_err != ESP_OK) || (has_scale && scale_err != ESP_OK)) return false;  // truncated
+  url_decode(roi);
+  url_decode(scale);
+  
+  v->w = SENSOR_FULL_W;
+  v->h = SENSOR_FULL_H;
+  v->scale_div = 1;
+  
+  unsigned x, y, w, h, num, den;
+  if (has_roi) {
+    if (sscanf(roi, "%u,%u,%u,%u", &x, &y, &w, &h) != 4 || w < 16 || h < 16 ||
+        x + w > SENSOR_FULL_W || y + h > SENSOR_FULL_H) {
+      return false;
+    }
+    v->x = x; v->y = y; v->w = w; v->h = h;
+  }
+  if (has_scale) {
+    if (sscanf(scale, "%u/%u", &num, &den) == 2 && num == 1 && den >= 1 && den <= 8) v->scale_div = den;
+    else if (sscanf(scale, "%u", &num) != 1 || num != 1) return false;
+  }
+  
+  // Without an ROI the scale applies to the normal stream size.
+  uint32_t sw = resolution[STREAM_FRAMESIZE].width;
+  uint32_t sh = resolution[STREAM_FRAMESIZE].height;
+  uint32_t out_w = has_roi ? v->w / v->scale_div : sw / v->scale_div;
+  uint32_t out_h = has_roi ? v->h / v->scale_div : sh / v->scale_div;
+  
+  // Stay within the stream frame's pixel budget: JPEG buffers are sized for it at init.
+  if (out_w * out_h > sw * sh) {
+    float k = sqrtf((float)(sw * sh) / (out_w * out_h));
+    out_w *= k;
+    out_h *= k;
+  }
+  out_w &= ~15u;
+  out_h &= ~7u;
+  if (out_w < 16 || out_h < 8) return false;
+  
+  // Cheapest sensor mode that still has at least out_w x out_h pixels in the ROI
+  static const uint16_t MODE_W[] = {1600, 800, 400};
+  static const uint16_t MODE_H[] = {1200, 600, 296};
+  int mode = 0;
+  for (int m = 2; m > 0; m--) {
+    if ((uint32_t)v->w * MODE_W[m] / SENSOR_FULL_W >= out_w &&
+        (uint32_t)v->h * MODE_H[m] / SENSOR_FULL_H >= out_h) {
+      mode = m;
+      break;
+    }
+  }
+  
+  v->mode = mode;
+  v->win_x = ((uint32_t)v->x * MODE_W[mode] / SENSOR_FULL_W) & ~3u;
+  v->win_y = ((uint32_t)v->y * MODE_H[mode] / SENSOR_FULL_H) & ~3u;
+  v->win_w = ((uint32_t)v->w * MODE_W[mode] / SENSOR_FULL_W) & ~3u;
+  v->win_h = ((uint32_t)v->h * MODE_H[mode] / SENSOR_FULL_H) & ~3u;
+  if (v->win_x + v->win_w > MODE_W[mode]) v->win_w = MODE_W[mode] - v->win_x;
+  if (v->win_y + v->win_h > MODE_H[mode]) v->win_h = MODE_H[mode] - v->win_y;
+  v->out_w = out_w < v->win_w ? out_w : v->win_w & ~15u;
+  v->out_h = out_h < v->win_h ? out_h : v->win_h & ~7u;
+  v->active = true;
+  return true;
+}
 
+// Names a live consumer other than this /stream that a sensor window would
+// change under, or nullptr if the view can have the sensor to itself.
+static const char* stream_view_conflict() {
+  if (g_stream_view.active) return "another view";
+  if (g_wss_client_count > 0) return "ws stream";
+  for (auto& r : g_rtsp) {
+    if (r.fd >= 0 && r.playing) return "rtsp";
+  }
+  if (g_udp_push_enabled) return "udp push";
+  if (g_is_recording) return "recording";
+  if (g_snap_last_req_ms && millis() - g_snap_last_req_ms <= SNAP_ACTIVE_MS) return "snapshot polling";
+  return nullptr;
+}
+
+// Only the OV2640 window layout is known here; other sensors fall back to the
+// plain stream frame size.
+static bool apply_stream_view(sensor_t* s, const StreamView& v) {
+  if (s->id.PID != OV2640_PID || !s->set_res_raw) return false;
+  return s->set_res_raw(s, v.mode, 0, 0, 0, v.win_x, v.win_y, v.win_w, v.win_h,
+                        v.out_w, v.out_h, false, false) == 0;
+}
+
+static int aq_quality(AqProfile p) {
+  AutoQuality& a = g_aq[p];
+  if (CFG(a.target_cfg) <= 0) return CFG(a.base_cfg);
+  if (a.quality == 0) a.quality = CFG(a.base_cfg);
+  return a.quality;
+}
+
+static void aq_reset(AqProfile p) {
+  g_aq[p].quality = 0;
+  g_aq[p].avg_len = 0;
+}
+
+// Makes `p` the profile driving the sensor and loads its quality.
+static void aq_activate(sensor_t* s, AqProfile p) {
+  g_aq_active = p;
+  g_aq[p].settle = (p == AQ_CAPTURE) ? 0 : AQ_SETTLE_FRAMES;
+  s->set_quality(s, aq_quality(p));
+}
+
+// Feeds one frame size into the controller. Quality moves in proportion to
+// log2(size / budget), so large misses converge in a few frames and small
+// ones inside the deadband are left alone.
+static void aq_observe(AqProfile p, size_t len) {
+  AutoQuality& a = g_aq[p];
+  int32_t target = CFG(a.target_cfg) * 1024;
+  if (target <= 0 || p != g_aq_active) return;
+  if (a.settle) {
+    a.settle--;
+    return;
+  }
+  
+  a.avg_len = (a.avg_len > 0) ? a.avg_len * 0.7f + len * 0.3f : len;
+  float ratio = a.avg_len / target;
+  if (fabsf(ratio - 1.0f) < AQ_DEADBAND) return;
+  
+  int step = (int)lroundf(log2f(ratio) * AQ_STEPS_PER_DOUBLING);
+  if (step == 0) step = (ratio > 1.0f) ? 1 : -1;
+  if (step > AQ_MAX_STEP) step = AQ_MAX_STEP;
+  if (step < -AQ_MAX_STEP) step = -AQ_MAX_STEP;
+  
+  int q = aq_quality(p) + step;
+  if (q < AQ_Q_MIN) q = AQ_Q_MIN;
+  if (q > AQ_Q_MAX) q = AQ_Q_MAX;
+  if (q == a.quality) return;
+  
+  a.quality = q;
+  a.settle = (p == AQ_CAPTURE) ? 0 : AQ_SETTLE_FRAMES;
+  sensor_t* s = esp_camera_sensor_get();
+  if (s) s->set_quality(s, q);
+}
+
+// Stream settings double as recording settings; only the quality budget differs.
 static void set_stream_mode() {
   sensor_t* s = esp_camera_sensor_get();
   if (s) {
-    s->set_framesize(s, STREAM_FRAMESIZE);
-    s->set_quality(s, STREAM_QUALITY);
+    if (!g_stream_view.active || !apply_stream_view(s, g_stream_view)) {
+      s->set_framesize(s, STREAM_FRAMESIZE);
+    }
+    cam_stats_mode_changed();
+    aq_activate(s, g_is_recording ? AQ_RECORD : AQ_STREAM);
   }
 }
 
@@ -421,7 +1362,8 @@ static void set_capture_mode() {
   sensor_t* s = esp_camera_sensor_get();
   if (s) {
     s->set_framesize(s, CAPTURE_FRAMESIZE);
-    s->set_quality(s, CAPTURE_QUALITY);
+    cam_stats_mode_changed();
+    aq_activate(s, AQ_CAPTURE);
     delay(10);
   }
 }
@@ -446,14 +1388,33 @@ static void setup_camera() {
   config.pin_sccb_scl = SIOC_GPIO_NUM;
   config.pin_pwdn = PWDN_GPIO_NUM;
   config.pin_reset = RESET_GPIO_NUM;
-  config.xclk_freq_hz = 20000000;
+  config.xclk_freq_hz = CFG(CFG_XCLK_MHZ) * 1000000;
   config.pixel_format = PIXFORMAT_JPEG;
   
-  config.frame_size = STREAM_FRAMESIZE;
+  // Buffers must hold the larger of the two modes we switch between
+  g_cam_init_framesize = STREAM_FRAMESIZE > CAPTURE_FRAMESIZE ? STREAM_FRAMESIZE : CAPTURE_FRAMESIZE;
+  config.frame_size = g_cam_init_framesize;
   config.jpeg_quality = STREAM_QUALITY;
-  config.fb_count = 3;
-  config.fb_location = CAMERA_FB_IN_PSRAM;
-  config.grab_mode = CAMERA_GRAB_LATEST;
+  
+  int profile = CFG(CFG_CAM_PROFILE);
+  g_cam_pool = CAM_PROFILES[profile];
+  if (profile == 0) {
+    g_cam_pool.fb_count = CFG(CFG_FB_COUNT);
+    g_cam_pool.psram = CFG(CFG_FB_PSRAM);
+    g_cam_pool.grab_latest = CFG(CFG_GRAB_LATEST);
+  }
+  if (!psramFound()) {
+    g_cam_pool.psram = false;
+    g_cam_pool.fb_count = 1;
+  }
+  config.fb_count = g_cam_pool.fb_count;
+  config.fb_location = g_cam_pool.psram ? CAMERA_FB_IN_PSRAM : CAMERA_FB_IN_DRAM;
+  config.grab_mode = g_cam_pool.grab_latest ? CAMERA_GRAB_LATEST : CAMERA_GRAB_WHEN_EMPTY;
+  
+  g_snap_lock = xSemaphoreCreateMutex();
+  g_snap_boot_id = esp_random();
+  g_prev_vprintf = esp_log_set_vprintf(cam_log_hook);
+  esp_log_level_set("cam_hal", ESP_LOG_WARN);
 
   esp_err_t err = esp_camera_init(&config);
   if (err != ESP_OK) {
@@ -477,8 +1438,110 @@ static void setup_camera() {
     s->set_wpc(s, 1);
     s->set_raw_gma(s, 1);
   }
+  set_stream_mode();
+
+  log_pushf("[cam] init OK (PSRAM=%s) pool=%s fb=%u %s %s", psramFound() ? "YES" : "NO",
+            g_cam_pool.name, g_cam_pool.fb_count, g_cam_pool.psram ? "psram" : "dram",
+            g_cam_pool.grab_latest ? "latest" : "queued");
+}
+
+// ============================ RUNTIME CONFIG ============================
+
+// Runs before log_init(), so it only reports back how many overrides it found.
+static int cfg_load() {
+  int overrides = 0;
+  nvs_handle_t h;
+  bool have_nvs = nvs_open(CFG_NVS_NAMESPACE, NVS_READONLY, &h) == ESP_OK;
+  
+  for (auto& p : g_cfg) {
+    int32_t v = p.def;
+    if (have_nvs && nvs_get_i32(h, p.key, &v) == ESP_OK && v >= p.min && v <= p.max) {
+      if (v != p.def) overrides++;
+    } else {
+      v = p.def;
+    }
+    p.value = p.stored = v;
+  }
+  
+  if (have_nvs) nvs_close(h);
+  return overrides;
+}
+
+static bool cfg_persist(const char* key, const int32_t* v) {
+  nvs_handle_t h;
+  if (nvs_open(CFG_NVS_NAMESPACE, NVS_READWRITE, &h) != ESP_OK) return false;
+  esp_err_t err = v ? nvs_set_i32(h, key, *v) : nvs_erase_all(h);
+  if (err == ESP_OK) err = nvs_commit(h);
+  nvs_close(h);
+  return err == ESP_OK;
+}
+
+// Pushes a hot param's new value into the driver.
+static void cfg_apply(CfgId id) {
+  sensor_t* s = esp_camera_sensor_get();
+  switch (id) {
+    case CFG_STREAM_FRAMESIZE:
+    case CFG_STREAM_QUALITY:
+      set_stream_mode();
+      break;
+    case CFG_XCLK_MHZ:
+      if (s && s->set_xclk) s->set_xclk(s, LEDC_TIMER_0, CFG(CFG_XCLK_MHZ));
+      break;
+    case CFG_STREAM_TARGET_KB:
+    case CFG_CAPTURE_TARGET_KB:
+    case CFG_RECORD_TARGET_KB:
+      for (int p = 0; p < AQ_COUNT; p++) {
+        if (g_aq[p].target_cfg == id) aq_reset((AqProfile)p);
+      }
+      if (g_aq_active != AQ_CAPTURE) set_stream_mode();
+      break;
+    default:
+      break;  // read on next use
+  }
+}
+
+// Records a new stored value and applies it now if the driver allows it.
+static void cfg_update(CfgId id, int32_t v) {
+  CfgParam& p = g_cfg[id];
+  p.stored = v;
+  
+  // Frame sizes above the one the JPEG buffers were allocated for would overflow
+  bool hot = p.apply == CFG_HOT;
+  if ((id == CFG_STREAM_FRAMESIZE || id == CFG_CAPTURE_FRAMESIZE) && v > g_cam_init_framesize) hot = false;
+  
+  if (hot) {
+    p.value = v;
+    cfg_apply(id);
+  }
+  log_pushf("[cfg] %s=%d (%s)", p.key, v, hot ? "applied" : "on reboot");
+}
+
+static bool cfg_set(CfgId id, int32_t v) {
+  CfgParam& p = g_cfg[id];
+  if (v < p.min || v > p.max) {
+    log_pushf("[cfg] %s=%d out of range %d..%d", p.key, v, p.min, p.max);
+    return false;
+  }
+  if (v == p.stored) return true;
+  
+  if (!cfg_persist(p.key, &v)) log_pushf("[cfg] NVS write failed: %s", p.key);
+  cfg_update(id, v);
+  return true;
+}
+
+static void cfg_reset() {
+  cfg_persist(nullptr, nullptr);
+  for (int i = 0; i < CFG_COUNT; i++) {
+    if (g_cfg[i].stored != g_cfg[i].def) cfg_update((CfgId)i, g_cfg[i].def);
+  }
+  log_pushf("[cfg] reset to defaults");
+}
 
-  log_pushf("[cam] init OK (PSRAM=%s)", psramFound() ? "YES" : "NO");
+static bool cfg_reboot_required() {
+  for (auto& p : g_cfg) {
+    if (p.value != p.stored) return true;
+  }
+  return false;
 }
 
 // ============================ WIFI ============================
@@ -550,73 +1613,196 @@ static void connect_wifi_dual() {
 
 // ============================ HTTP HANDLERS ============================
 
-static esp_err_t capture_handler(httpd_req_t *req) {
-  log_pushf("[http] capture request");
+// GET /capture?snapshot=1[&max_age=ms]
+// Serves the cached stream frame if it is younger than max_age (default
+// 1000), otherwise pulls one stream frame without a mode switch. Honors
+// If-None-Match against the frame's ETag.
+static esp_err_t snapshot_handler(httpd_req_t *req, const char* query) {
+  char val[12];
+  uint32_t max_age = SNAP_DEFAULT_MAX_AGE_MS;
+  if (httpd_query_key_value(query, "max_age", val, sizeof(val)) == ESP_OK) max_age = strtoul(val, NULL, 10);
   
-  set_capture_mode();
+  g_snap_last_req_ms = millis();
   
-  camera_fb_t* fb = esp_camera_fb_get();
-  if (fb) esp_camera_fb_return(fb);
+  xSemaphoreTake(g_snap_lock, portMAX_DELAY);
+  bool fresh = g_snap.len && millis() - g_snap.captured_ms <= max_age;
+  xSemaphoreGive(g_snap_lock);
   
-  fb = esp_camera_fb_get();
-  if (!fb) {
-    set_stream_mode();
+  if (fresh) {
+    g_snap_hits++;
+  } else {
+    // Nobody is streaming (or the cache is stale): take one stream frame
+    // without a mode switch. cam_fb_get() has usually cached it already;
+    // offering it again only waits for the lock if that try failed.
+    g_snap_misses++;
+    camera_fb_t* fb = cam_fb_get();
+    if (fb && millis() - (uint32_t)(fb->timestamp.tv_sec * 1000 + fb->timestamp.tv_usec / 1000) > max_age) {
+      // An old exposure from a queued pool; drain it like /capture does
+      cam_fb_return(fb);
+      fb = cam_fb_get();
+    }
+    if (!fb) {
+      httpd_resp_send_500(req);
+      return ESP_FAIL;
+    }
+    bool cached = snapshot_offer(fb, portMAX_DELAY);
+    cam_fb_return(fb);
+    if (!cached) {
+      // Sensor is busy with a still or a view; not a stream frame
+      httpd_resp_set_status(req, "503 Service Unavailable");
+      httpd_resp_set_hdr(req, "Retry-After", "1");
+      httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+      return httpd_resp_send(req, NULL, 0);
+    }
+  }
+  
+  xSemaphoreTake(g_snap_lock, portMAX_DELAY);
+  
+  char etag[24];
+  snprintf(etag, sizeof(etag), "\"%08x-%u\"", g_snap_boot_id, g_snap.seq);
+  char age[12];
+  snprintf(age, sizeof(age), "%u", (millis() - g_snap.captured_ms) / 1000);
+  char cache[24];
+  snprintf(cache, sizeof(cache), "max-age=%u", max_age / 1000);
+  
+  httpd_resp_set_hdr(req, "ETag", etag);
+  httpd_resp_set_hdr(req, "Age", age);
+  httpd_resp_set_hdr(req, "Cache-Control", cache);
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  
+  esp_err_t res;
+  char inm[24];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", inm, sizeof(inm)) == ESP_OK && strcmp(inm, etag) == 0) {
+    httpd_resp_set_status(req, "304 Not Modified");
+    res = httpd_resp_send(req, NULL, 0);
+  } else {
+    httpd_resp_set_type(req, "image/jpeg");
+    httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=snapshot.jpg");
+    res = httpd_resp_send(req, (const char*)g_snap.buf, g_snap.len);
+  }
+  
+  xSemaphoreGive(g_snap_lock);
+  return res;
+}
+
+// "http,sd,thumb,journal,notify" -> SINK_* bits
+static uint8_t parse_sinks(const char* list) {
+  static const struct { const char* name; uint8_t bit; } names[] = {
+    {"http", SINK_HTTP}, {"sd", SINK_SD}, {"thumb", SINK_THUMB},
+    {"journal", SINK_JOURNAL}, {"notify", SINK_NOTIFY},
+  };
+  uint8_t sinks = 0;
+  while (*list) {
+    size_t n = strcspn(list, ",");
+    for (auto& s : names) {
+      if (strlen(s.name) == n && strncmp(list, s.name, n) == 0) sinks |= s.bit;
+    }
+    list += n;
+    if (*list == ',') list++;
+  }
+  return sinks;
+}
+
+// GET /capture[?sinks=http,sd,thumb,journal,notify]
+// Takes one still and hands it to every listed sink (default: http only).
+// With http the JPEG is the response body, sent while the SD sinks write the
+// same copy; without it the reply is a JSON receipt.
+static esp_err_t capture_handler(httpd_req_t *req) {
+  char query[96];
+  char val[48];
+  uint8_t sinks = SINK_HTTP;
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    if (httpd_query_key_value(query, "snapshot", val, sizeof(val)) == ESP_OK && val[0] == '1') {
+      return snapshot_handler(req, query);
+    }
+    if (httpd_query_key_value(query, "sinks", val, sizeof(val)) == ESP_OK) {
+      sinks = parse_sinks(val);
+      if (!sinks) return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "no known sink");
+    }
+  }
+  
+  log_pushf("[http] capture request (sinks=0x%02x)", sinks);
+  
+  CaptureFrame* c = capture_frame("http", sinks, false);
+  if (!c) {
     log_pushf("[cam] capture failed");
     httpd_resp_send_500(req);
     return ESP_FAIL;
   }
-
-  httpd_resp_set_type(req, "image/jpeg");
-  httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
+  capture_dispatch(c);
+  
+  char seq[12];
+  snprintf(seq, sizeof(seq), "%u", c->seq);
+  httpd_resp_set_hdr(req, "X-Capture-Seq", seq);
+  if (c->sinks & SINK_SD) httpd_resp_set_hdr(req, "X-Saved-As", c->path);
   httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  esp_err_t res = httpd_resp_send(req, (const char*)fb->buf, fb->len);
   
-  esp_camera_fb_return(fb);
-  set_stream_mode();
+  esp_err_t res;
+  if (c->sinks & SINK_HTTP) {
+    httpd_resp_set_type(req, "image/jpeg");
+    httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
+    res = httpd_resp_send(req, (const char*)c->buf, c->len);
+    capture_http_done(c, res == ESP_OK);
+  } else {
+    char response[128];
+    snprintf(response, sizeof(response), "{\"seq\":%u,\"bytes\":%u,\"sinks\":%u,\"path\":\"%s\"}",
+             c->seq, (unsigned)c->len, c->sinks, c->path);
+    httpd_resp_set_type(req, "application/json");
+    res = httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
+  }
   
+  capture_release(c);
   return res;
 }
 
 // ============================ EYE TRACK CAPTURE HANDLER ============================
 
-static esp_err_t eyetrack_capture_handler(httpd_req_t *req) {
+// Shared by the HTTP and WebSocket trigger paths. On failure *err names the cause.
+static bool eyetrack_capture(char* filename, size_t filename_len, const char** err) {
   g_eyetrack_triggers++;
   log_pushf("[eye] capture trigger #%u", g_eyetrack_triggers);
   
   if (!g_sd_available) {
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_send(req, "{\"success\":false,\"error\":\"SD card not available\"}", HTTPD_RESP_USE_STRLEN);
-    return ESP_OK;
+    *err = "SD card not available";
+    return false;
   }
   
   set_capture_mode();
   
-  camera_fb_t* fb = esp_camera_fb_get();
-  if (fb) esp_camera_fb_return(fb);
+  camera_fb_t* fb = cam_fb_get();
+  if (fb) cam_fb_return(fb);
   
-  fb = esp_camera_fb_get();
+  fb = cam_fb_get();
   if (!fb) {
     set_stream_mode();
     log_pushf("[eye] capture failed - no frame");
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_send(req, "{\"success\":false,\"error\":\"Camera capture failed\"}", HTTPD_RESP_USE_STRLEN);
-    return ESP_OK;
+    *err = "Camera capture failed";
+    return false;
   }
+  aq_observe(AQ_CAPTURE, fb->len);
 
-  char filename[64];
-  bool saved = save_eyetrack_photo(fb, filename, sizeof(filename));
+  bool saved = save_eyetrack_photo(fb, filename, filename_len);
   
-  esp_camera_fb_return(fb);
+  cam_fb_return(fb);
   set_stream_mode();
   
-  if (saved) {
-    g_eyetrack_captures++;
-    log_pushf("[eye] saved: %s (total=%u)", filename, g_eyetrack_captures);
-    
-    set_flash(true);
-    delay(50);
-    set_flash(false);
-    
+  if (!saved) {
+    *err = "Failed to save";
+    return false;
+  }
+  
+  g_eyetrack_captures++;
+  log_pushf("[eye] saved: %s (total=%u)", filename, g_eyetrack_captures);
+  
+  led_play(LED_EYE);
+  return true;
+}
+
+static esp_err_t eyetrack_capture_handler(httpd_req_t *req) {
+  char filename[64];
+  const char* err = nullptr;
+  
+  if (eyetrack_capture(filename, sizeof(filename), &err)) {
     char response[128];
     snprintf(response, sizeof(response), 
              "{\"success\":true,\"filename\":\"%s\",\"total\":%u}", 
@@ -625,8 +1811,10 @@ static esp_err_t eyetrack_capture_handler(httpd_req_t *req) {
     httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
     httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
   } else {
+    char response[96];
+    snprintf(response, sizeof(response), "{\"success\":false,\"error\":\"%s\"}", err);
     httpd_resp_set_type(req, "application/json");
-    httpd_resp_send(req, "{\"success\":false,\"error\":\"Failed to save\"}", HTTPD_RESP_USE_STRLEN);
+    httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
   }
   
   return ESP_OK;
@@ -674,6 +1862,29 @@ static esp_err_t stream_handler(httpd_req_t *req) {
   static const char* STREAM_BOUNDARY = "\r\n--frame\r\n";
   static const char* STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n";
   
+  char query[96];
+  StreamView view = {};
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK && !parse_stream_view(query, &view)) {
+    log_pushf("[stream] rejected view: %s", query);
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid roi/scale");
+  }
+  bool has_view = view.active;
+  if (has_view) {
+    const char* conflict = stream_view_conflict();
+    if (conflict) {
+      log_pushf("[stream] view refused: sensor in use by %s", conflict);
+      char msg[64];
+      snprintf(msg, sizeof(msg), "sensor in use by %s", conflict);
+      httpd_resp_set_status(req, "409 Conflict");
+      httpd_resp_set_type(req, "text/plain");
+      httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+      return httpd_resp_send(req, msg, HTTPD_RESP_USE_STRLEN);
+    }
+    g_stream_view = view;
+    log_pushf("[stream] view roi=%u,%u,%ux%u -> %ux%u (mode %u)",
+              view.x, view.y, view.w, view.h, view.out_w, view.out_h, view.mode);
+  }
+  
   httpd_resp_set_type(req, STREAM_CONTENT_TYPE);
   httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
   httpd_resp_set_hdr(req, "X-Framerate", "20");
@@ -681,8 +1892,8 @@ static esp_err_t stream_handler(httpd_req_t *req) {
   set_stream_mode();
   
   for (int i = 0; i < 2; i++) {
-    camera_fb_t* fb = esp_camera_fb_get();
-    if (fb) esp_camera_fb_return(fb);
+    camera_fb_t* fb = cam_fb_get();
+    if (fb) cam_fb_return(fb);
   }
   
   char part_buf[64];
@@ -694,23 +1905,24 @@ static esp_err_t stream_handler(httpd_req_t *req) {
   while (true) {
     uint32_t frame_start = millis();
     
-    camera_fb_t* fb = esp_camera_fb_get();
+    camera_fb_t* fb = cam_fb_get();
     if (!fb) {
       log_pushf("[stream] frame failed");
       res = ESP_FAIL;
       break;
     }
+    aq_observe(AQ_STREAM, fb->len);
     
     size_t hlen = snprintf(part_buf, sizeof(part_buf), STREAM_PART, fb->len);
     
     if (httpd_resp_send_chunk(req, STREAM_BOUNDARY, strlen(STREAM_BOUNDARY)) != ESP_OK ||
         httpd_resp_send_chunk(req, part_buf, hlen) != ESP_OK ||
         httpd_resp_send_chunk(req, (const char*)fb->buf, fb->len) != ESP_OK) {
-      esp_camera_fb_return(fb);
+      cam_fb_return(fb);
       break;
     }
     
-    esp_camera_fb_return(fb);
+    cam_fb_return(fb);
     
     frame_count++;
     fps_frame_count++;
@@ -729,21 +1941,123 @@ static esp_err_t stream_handler(httpd_req_t *req) {
     }
   }
   
+  if (has_view) {
+    g_stream_view.active = false;
+    set_stream_mode();
+  }
+  
   log_pushf("[stream] ended after %u frames", frame_count);
   return res;
 }
 
+// GET /flash?on=1[&level=0..255]
 static esp_err_t flash_handler(httpd_req_t *req) {
-  char buf[8];
-  if (httpd_req_get_url_query_str(req, buf, sizeof(buf)) == ESP_OK) {
-    bool on = (buf[3] == '1');
-    set_flash(on);
-    log_pushf("[flash] %s", on ? "ON" : "OFF");
+  char buf[32];
+  char val[8];
+  if (httpd_req_get_url_query_str(req, buf, sizeof(buf)) == ESP_OK &&
+      httpd_query_key_value(buf, "on", val, sizeof(val)) == ESP_OK) {
+    bool on = (val[0] == '1');
+    int level = 255;
+    if (httpd_query_key_value(buf, "level", val, sizeof(val)) == ESP_OK) {
+      level = constrain(atoi(val), 0, 255);
+    }
+    set_flash_level(on ? level : 0);
+    log_pushf("[flash] %s level=%d", on ? "ON" : "OFF", on ? level : 0);
   }
   httpd_resp_set_type(req, "text/plain");
   return httpd_resp_send(req, "OK", 2);
 }
 
+// GET /config                 -> all params as JSON
+// GET /config?stream_q=10&... -> set any number of params by key, then report
+// GET /config?reset=1         -> erase NVS overrides
+// GET /config?reboot=1        -> restart after replying (applies CFG_REBOOT params)
+static esp_err_t config_handler(httpd_req_t *req) {
+  char query[256] = {0};
+  char val[16];
+  bool reboot = false;
+  
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    if (httpd_query_key_value(query, "reset", val, sizeof(val)) == ESP_OK) cfg_reset();
+    for (int i = 0; i < CFG_COUNT; i++) {
+      if (httpd_query_key_value(query, g_cfg[i].key, val, sizeof(val)) == ESP_OK) {
+        cfg_set((CfgId)i, atoi(val));
+      }
+    }
+    reboot = httpd_query_key_value(query, "reboot", val, sizeof(val)) == ESP_OK;
+  }
+  
+  String json = "{\"params\":[";
+  for (int i = 0; i < CFG_COUNT; i++) {
+    const CfgParam& p = g_cfg[i];
+    char entry[160];
+    snprintf(entry, sizeof(entry),
+             "%s{\"key\":\"%s\",\"value\":%d,\"stored\":%d,\"default\":%d,\"min\":%d,\"max\":%d,\"apply\":\"%s\"}",
+             i ? "," : "", p.key, p.value, p.stored, p.def, p.min, p.max,
+             p.apply == CFG_HOT ? "hot" : "reboot");
+    json += entry;
+  }
+  json += "],\"reboot_required\":";
+  json += cfg_reboot_required() ? "true}" : "false}";
+  
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  esp_err_t res = httpd_resp_send(req, json.c_str(), json.length());
+  
+  if (reboot) {
+    log_pushf("[cfg] rebooting");
+    delay(200);
+    ESP.restart();
+  }
+  return res;
+}
+
+// GET /camera/stats[?reset=1] -> frame buffer pool and usage telemetry
+static esp_err_t camera_stats_handler(httpd_req_t *req) {
+  char query[32];
+  char val[4];
+  bool reset = httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+               httpd_query_key_value(query, "reset", val, sizeof(val)) == ESP_OK;
+  
+  portENTER_CRITICAL(&g_cam_stats_mux);
+  CamStats st = g_cam_stats;
+  if (reset) {
+    uint32_t held = g_cam_stats.held;
+    memset(&g_cam_stats, 0, sizeof(g_cam_stats));
+    g_cam_stats.held = held;
+  }
+  portEXIT_CRITICAL(&g_cam_stats_mux);
+  
+  // The driver sizes each JPEG buffer at width * height / 5 of the init frame size
+  size_t capacity = (size_t)resolution[g_cam_init_framesize].width * resolution[g_cam_init_framesize].height / 5;
+  uint32_t returned = st.frames - st.held;
+  
+  char response[640];
+  snprintf(response, sizeof(response),
+           "{\"pool\":{\"profile\":\"%s\",\"fb_count\":%u,\"location\":\"%s\",\"grab\":\"%s\",\"buf_bytes\":%u},"
+           "\"frames\":%u,\"get_fail\":%u,\"skipped\":%u,\"truncated\":%u,\"ovf\":%u,\"no_eoi\":%u,"
+           "\"held\":%u,\"held_max\":%u,\"hold_avg_us\":%u,\"hold_max_us\":%u,"
+           "\"wait_avg_us\":%u,\"wait_max_us\":%u,\"sensor_interval_us\":%u,"
+           "\"max_len\":%u,\"max_fill_pct\":%u,\"snap_hits\":%u,\"snap_misses\":%u}",
+           g_cam_pool.name, g_cam_pool.fb_count, g_cam_pool.psram ? "psram" : "dram",
+           g_cam_pool.grab_latest ? "latest" : "queued", (unsigned)capacity,
+           st.frames, st.get_fail, st.skipped, st.truncated, g_cam_ovf, g_cam_no_eoi,
+           st.held, st.held_max,
+           returned ? (uint32_t)(st.hold_us_total / returned) : 0, st.hold_us_max,
+           st.frames ? (uint32_t)(st.wait_us_total / st.frames) : 0, st.wait_us_max,
+           st.min_interval_us, (unsigned)st.max_len,
+           capacity ? (unsigned)(st.max_len * 100 / capacity) : 0, g_snap_hits, g_snap_misses);
+  
+  if (reset) {
+    g_cam_ovf = g_cam_no_eoi = 0;
+    g_snap_hits = g_snap_misses = 0;
+  }
+  
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
+}
+
 // ============================ SSE EVENTS ============================
 
 static void sse_send_line(httpd_req_t *req, const char* s) {
@@ -755,12 +2069,12 @@ static void sse_send_line(httpd_req_t *req, const char* s) {
 static void sse_send_recent(httpd_req_t *req, int max_lines) {
   portENTER_CRITICAL(&g_log_mux);
   int head = g_log_head;
-  int count = (g_log_seq < LOG_CAP) ? g_log_seq : LOG_CAP;
+  int count = (g_log_seq < (uint32_t)g_log_cap) ? g_log_seq : g_log_cap;
   portEXIT_CRITICAL(&g_log_mux);
   
   int start = (count < max_lines) ? 0 : (count - max_lines);
   for (int i = start; i < count; i++) {
-    int idx = (head - count + i + LOG_CAP) % LOG_CAP;
+    int idx = (head - count + i + g_log_cap) % g_log_cap;
     if (g_log[idx][0]) {
       sse_send_line(req, g_log[idx]);
     }
@@ -783,7 +2097,7 @@ static esp_err_t events_handler(httpd_req_t *req) {
       uint32_t seq = g_log_seq;
       portEXIT_CRITICAL(&g_log_mux);
       
-      int idx = (head - 1 + LOG_CAP) % LOG_CAP;
+      int idx = (head - 1 + g_log_cap) % g_log_cap;
       if (g_log[idx][0]) {
         char buf[256];
         int len = snprintf(buf, sizeof(buf), "data: %s\n\n", g_log[idx]);
@@ -803,160 +2117,1076 @@ static esp_err_t log_clear_handler(httpd_req_t *req) {
   return httpd_resp_send(req, "OK", 2);
 }
 
-// ============================ SD CARD HANDLERS ============================
+// ============================ WEBSOCKET CONTROL ============================
 
-static esp_err_t sd_status_handler(httpd_req_t *req) {
-  char buf[128];
+static void ws_client_add(int fd) {
+  uint32_t seq = g_log_seq;
+  uint32_t backlog = (seq < (uint32_t)WS_BACKLOG_LINES) ? seq : WS_BACKLOG_LINES;
   
-  if (g_sd_available) {
-    uint64_t total = SD_MMC.totalBytes() / (1024 * 1024);
-    uint64_t used = SD_MMC.usedBytes() / (1024 * 1024);
-    snprintf(buf, sizeof(buf), 
-             "{\"available\":true,\"total_mb\":%llu,\"used_mb\":%llu,\"recording\":%s}",
-             total, used, g_is_recording ? "true" : "false");
-  } else {
-    snprintf(buf, sizeof(buf), "{\"available\":false}");
+  portENTER_CRITICAL(&g_ws_mux);
+  int slot = -1;
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (g_ws_clients[i].fd == fd) { slot = i; break; }
+    if (slot < 0 && g_ws_clients[i].fd < 0) slot = i;
   }
+  if (slot >= 0) {
+    if (g_ws_clients[slot].fd != fd) g_ws_client_count++;
+    g_ws_clients[slot].fd = fd;
+    g_ws_clients[slot].log_seq = seq - backlog;
+  }
+  portEXIT_CRITICAL(&g_ws_mux);
   
-  httpd_resp_set_type(req, "application/json");
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  return httpd_resp_send(req, buf, HTTPD_RESP_USE_STRLEN);
+  if (slot < 0) {
+    log_pushf("[ws] client table full, fd=%d not tracked", fd);
+  } else if (g_ws_task) {
+    xTaskNotifyGive(g_ws_task);
+  }
 }
 
-static esp_err_t sd_list_handler(httpd_req_t *req) {
-  if (!g_sd_available) {
-    httpd_resp_set_type(req, "application/json");
-    return httpd_resp_send(req, "{\"files\":[]}", HTTPD_RESP_USE_STRLEN);
+static bool ws_client_remove(int fd) {
+  bool removed = false;
+  portENTER_CRITICAL(&g_ws_mux);
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (g_ws_clients[i].fd == fd) {
+      g_ws_clients[i].fd = -1;
+      g_ws_client_count--;
+      removed = true;
+    }
   }
+  portEXIT_CRITICAL(&g_ws_mux);
+  return removed;
+}
+
+static bool ws_send(int fd, const uint8_t* data, size_t len) {
+  if (httpd_ws_get_fd_info(g_httpd, fd) != HTTPD_WS_CLIENT_WEBSOCKET) return false;
   
-  String json = "{\"files\":[";
-  bool first = true;
+  httpd_ws_frame_t frame = {};
+  frame.final = true;
+  frame.type = HTTPD_WS_TYPE_BINARY;
+  frame.payload = (uint8_t*)data;
+  frame.len = len;
   
-  const char* dirs[] = {"/photos", "/videos", "/eyetrack"};
-  const char* types[] = {"photo", "video", "eyetrack"};
+  xSemaphoreTake(g_ws_send_lock, portMAX_DELAY);
+  esp_err_t err = httpd_ws_send_frame_async(g_httpd, fd, &frame);
+  xSemaphoreGive(g_ws_send_lock);
+  return err == ESP_OK;
+}
+
+// Best effort: a client that can't take the message is left for ws_push_task
+// to notice and drop.
+static void ws_broadcast(const uint8_t* data, size_t len) {
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    portENTER_CRITICAL(&g_ws_mux);
+    int fd = g_ws_clients[i].fd;
+    portEXIT_CRITICAL(&g_ws_mux);
+    if (fd >= 0) ws_send(fd, data, len);
+  }
+}
+
+static void ws_build_status(WsStatusMsg* m) {
+  memset(m, 0, sizeof(*m));
+  m->op = WS_MSG_STATUS;
+  m->flags = (WiFi.status() == WL_CONNECTED ? 0x01 : 0) |
+             (g_sd_available ? 0x02 : 0) |
+             (g_is_recording ? 0x04 : 0);
+  m->rssi = (int8_t)WiFi.RSSI();
+  m->uptime_s = (millis() - g_boot_ms) / 1000;
+  m->heap = ESP.getFreeHeap();
+  m->triggers = g_eyetrack_triggers;
+  m->captures = g_eyetrack_captures;
+  m->sd_used_mb = g_sd_used_mb;
+  m->sd_total_mb = g_sd_total_mb;
+  m->sd_rev = g_sd_rev;
+}
+
+static void ws_refresh_sd_usage() {
+  if (!g_sd_available) return;
+  g_sd_total_mb = SD_MMC.totalBytes() / (1024 * 1024);
+  g_sd_used_mb = SD_MMC.usedBytes() / (1024 * 1024);
+}
+
+// Sends every log line the client has not seen yet. Returns false if the socket is gone.
+static bool ws_flush_log(int fd, uint32_t* log_seq) {
+  uint8_t msg[1 + LOG_LEN];
+  msg[0] = WS_MSG_LOG;
   
-  for (int d = 0; d < 3; d++) {
-    File root = SD_MMC.open(dirs[d]);
-    if (!root) continue;
+  uint32_t newest = g_log_seq;
+  if (*log_seq > newest) *log_seq = 0;  // log was cleared
+  if (newest - *log_seq > (uint32_t)g_log_cap) *log_seq = newest - g_log_cap;
+  
+  while (*log_seq < newest) {
+    if (log_read(*log_seq, (char*)msg + 1, LOG_LEN)) {
+      if (!ws_send(fd, msg, 1 + strlen((char*)msg + 1))) return false;
+    }
+    (*log_seq)++;
+  }
+  return true;
+}
+
+// Pushes log lines as they are written and a status frame every WS_STATUS_PUSH_MS
+// (or sooner when the SD contents change). Sleeps while no client is connected.
+static void ws_push_task(void*) {
+  uint32_t last_status_ms = 0;
+  uint32_t last_sd_ms = 0;
+  uint32_t last_rev = g_sd_rev;
+  
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(WS_STATUS_PUSH_MS));
+    if (g_ws_client_count == 0) continue;
     
-    File file = root.openNextFile();
-    while (file) {
-      if (!file.isDirectory()) {
-        if (!first) json += ",";
-        first = false;
-        
-        char entry[128];
-        snprintf(entry, sizeof(entry), 
-                 "{\"name\":\"%s\",\"path\":\"%s/%s\",\"size\":%u,\"type\":\"%s\"}",
-                 file.name(), dirs[d], file.name(), file.size(), types[d]);
-        json += entry;
+    uint32_t now = millis();
+    uint32_t rev = g_sd_rev;
+    if (rev != last_rev || now - last_sd_ms >= WS_SD_REFRESH_MS) {
+      ws_refresh_sd_usage();
+      last_sd_ms = now;
+    }
+    
+    bool push_status = (rev != last_rev) || (now - last_status_ms >= WS_STATUS_PUSH_MS);
+    WsStatusMsg status;
+    if (push_status) {
+      ws_build_status(&status);
+      last_status_ms = now;
+      last_rev = rev;
+    }
+    
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+      portENTER_CRITICAL(&g_ws_mux);
+      int fd = g_ws_clients[i].fd;
+      uint32_t log_seq = g_ws_clients[i].log_seq;
+      portEXIT_CRITICAL(&g_ws_mux);
+      if (fd < 0) continue;
+      
+      bool ok = ws_flush_log(fd, &log_seq);
+      if (ok && push_status) ok = ws_send(fd, (const uint8_t*)&status, sizeof(status));
+      
+      if (!ok) {
+        if (ws_client_remove(fd)) log_pushf("[ws] client %d dropped", fd);
+        continue;
       }
-      file = root.openNextFile();
+      
+      portENTER_CRITICAL(&g_ws_mux);
+      if (g_ws_clients[i].fd == fd) g_ws_clients[i].log_seq = log_seq;
+      portEXIT_CRITICAL(&g_ws_mux);
     }
-    root.close();
   }
+}
+
+static esp_err_t ws_handler(httpd_req_t *req) {
+  int fd = httpd_req_to_sockfd(req);
   
-  json += "]}";
+  if (req->method == HTTP_GET) {
+    ws_client_add(fd);
+    log_pushf("[ws] client %d connected", fd);
+    return ESP_OK;
+  }
   
-  httpd_resp_set_type(req, "application/json");
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  return httpd_resp_send(req, json.c_str(), json.length());
+  uint8_t buf[WS_RX_MAX];
+  httpd_ws_frame_t frame = {};
+  frame.payload = buf;
+  esp_err_t err = httpd_ws_recv_frame(req, &frame, sizeof(buf));
+  if (err != ESP_OK) return err;
+  if (frame.type != HTTPD_WS_TYPE_BINARY || frame.len < 1) return ESP_OK;
+  
+  switch (buf[0]) {
+    case WS_MSG_TRIGGER: {
+      uint8_t reply[8 + 64];
+      const char* err_text = nullptr;
+      bool ok = eyetrack_capture((char*)reply + 8, 64, &err_text);
+      if (!ok) strncpy((char*)reply + 8, err_text, 63);
+      reply[8 + 63] = '\0';
+      reply[0] = WS_MSG_TRIGGER;
+      reply[1] = ok ? 1 : 0;
+      reply[2] = reply[3] = 0;
+      memcpy(reply + 4, &g_eyetrack_captures, 4);
+      ws_send(fd, reply, 8 + strlen((char*)reply + 8));
+      break;
+    }
+    case WS_MSG_FLASH: {
+      bool on = frame.len > 1 && buf[1];
+      set_flash(on);
+      log_pushf("[flash] %s", on ? "ON" : "OFF");
+      uint8_t reply[2] = {WS_MSG_FLASH, (uint8_t)(on ? 1 : 0)};
+      ws_send(fd, reply, sizeof(reply));
+      break;
+    }
+    case WS_MSG_STATUS: {
+      WsStatusMsg status;
+      ws_build_status(&status);
+      ws_send(fd, (const uint8_t*)&status, sizeof(status));
+      break;
+    }
+    case WS_MSG_PING:
+      ws_send(fd, buf, frame.len);
+      break;
+    default:
+      log_pushf("[ws] unknown op 0x%02x", buf[0]);
+      break;
+  }
+  return ESP_OK;
 }
 
-static esp_err_t sd_download_handler(httpd_req_t *req) {
-  char query[128] = {0};
-  char filepath[96] = {0};
+// ============================ CAPTURE PIPELINE ============================
+
+// Grabs one still and copies it out of the driver buffer. The returned frame
+// holds one reference for the caller. With prepared the sensor is already in
+// capture mode (button press edge).
+static CaptureFrame* capture_frame(const char* source, uint8_t sinks, bool prepared) {
+  if (!g_sd_available) sinks &= ~SINKS_NEED_SD;
   
-  if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) {
-    return httpd_resp_send_404(req);
-  }
+  if (!prepared) set_capture_mode();
   
-  if (httpd_query_key_value(query, "file", filepath, sizeof(filepath)) != ESP_OK) {
-    return httpd_resp_send_404(req);
+  // The queued pools can hold several stream-size frames from before the
+  // switch; skip them until a full-size exposure arrives.
+  uint16_t want_w = resolution[CAPTURE_FRAMESIZE].width;
+  uint16_t want_h = resolution[CAPTURE_FRAMESIZE].height;
+  camera_fb_t* fb = nullptr;
+  for (int i = 0; i <= g_cam_pool.fb_count; i++) {
+    fb = cam_fb_get();
+    if (!fb || (fb->width == want_w && fb->height == want_h)) break;
+    cam_fb_return(fb);
+    fb = nullptr;
+  }
+  if (!fb) {
+    set_stream_mode();
+    log_pushf("[cap] no %ux%u frame after %u tries", want_w, want_h, g_cam_pool.fb_count + 1);
+    return nullptr;
   }
+  aq_observe(AQ_CAPTURE, fb->len);
   
-  char decoded[96];
-  int di = 0;
-  for (int i = 0; filepath[i] && di < 95; i++) {
-    if (filepath[i] == '%' && filepath[i+1] && filepath[i+2]) {
-      char hex[3] = {filepath[i+1], filepath[i+2], 0};
-      decoded[di++] = (char)strtol(hex, NULL, 16);
-      i += 2;
-    } else {
-      decoded[di++] = filepath[i];
-    }
+  size_t len = fb->len;
+  CaptureFrame* c = (CaptureFrame*)calloc(1, sizeof(CaptureFrame));
+  uint8_t* buf = (uint8_t*)(psramFound() ? ps_malloc(len) : malloc(len));
+  if (c && buf) {
+    memcpy(buf, fb->buf, len);
+    c->buf = buf;
+    c->len = len;
+    c->width = fb->width;
+    c->height = fb->height;
   }
-  decoded[di] = 0;
+  cam_fb_return(fb);
+  set_stream_mode();
   
-  File file = SD_MMC.open(decoded);
-  if (!file || file.isDirectory()) {
-    return httpd_resp_send_404(req);
+  if (!c || !buf) {
+    log_pushf("[cap] no memory for %u bytes", len);
+    free(c);
+    free(buf);
+    return nullptr;
   }
   
-  httpd_resp_set_type(req, "application/octet-stream");
+  c->captured_ms = millis();
+  c->source = source;
+  c->sinks = sinks;
+  c->refs = 1;
+  portENTER_CRITICAL(&g_cap_mux);
+  c->seq = ++g_cap_seq;
+  uint32_t num = (sinks & (SINK_SD | SINK_THUMB)) ? g_photo_counter++ : 0;
+  portEXIT_CRITICAL(&g_cap_mux);
+  if (sinks & (SINK_SD | SINK_THUMB)) snprintf(c->path, sizeof(c->path), "/photos/IMG_%04u.jpg", num);
+  return c;
+}
+
+static void capture_release(CaptureFrame* c) {
+  portENTER_CRITICAL(&g_cap_mux);
+  bool last = --c->refs == 0;
+  portEXIT_CRITICAL(&g_cap_mux);
+  if (!last) return;
+  free(c->buf);
+  free(c);
+}
+
+static void capture_mark(CaptureFrame* c, uint8_t sink) {
+  portENTER_CRITICAL(&g_cap_mux);
+  c->done |= sink;
+  portEXIT_CRITICAL(&g_cap_mux);
+}
+
+// Queues the frame for its non-HTTP sinks, taking a reference for the
+// capture task. The caller keeps its own reference for the HTTP sink.
+// Journal and notify wait for both the card writes and the HTTP send, but
+// nobody blocks on them: whichever of the two finishes last runs them.
+static void capture_dispatch(CaptureFrame* c) {
+  if (!(c->sinks & ~SINK_HTTP)) return;
   
-  char header[128];
-  snprintf(header, sizeof(header), "attachment; filename=\"%s\"", file.name());
-  httpd_resp_set_hdr(req, "Content-Disposition", header);
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  portENTER_CRITICAL(&g_cap_mux);
+  c->refs++;
+  c->pending = (c->sinks & SINK_HTTP) ? 2 : 1;
+  portEXIT_CRITICAL(&g_cap_mux);
   
-  char buf[1024];
-  size_t read;
-  while ((read = file.read((uint8_t*)buf, sizeof(buf))) > 0) {
-    if (httpd_resp_send_chunk(req, buf, read) != ESP_OK) {
-      file.close();
-      return ESP_FAIL;
-    }
+  if (!g_cap_queue || xQueueSend(g_cap_queue, &c, 0) != pdTRUE) {
+    log_pushf("[cap] #%u dropped: sink queue full", c->seq);
+    c->sinks &= SINK_HTTP;
+    capture_release(c);
+  }
+}
+
+static bool write_sd_file(const char* path, const uint8_t* buf, size_t len) {
+  File file = SD_MMC.open(path, FILE_WRITE);
+  if (!file) {
+    log_pushf("[sd] create failed: %s", path);
+    return false;
   }
   
+  size_t written = file.write(buf, len);
   file.close();
-  httpd_resp_send_chunk(req, NULL, 0);
-  return ESP_OK;
+  g_sd_rev++;
+  
+  if (written != len) {
+    log_pushf("[sd] write error: %u/%u", written, len);
+    return false;
+  }
+  return true;
 }
 
-static esp_err_t sd_delete_handler(httpd_req_t *req) {
-  char query[128] = {0};
-  char filepath[96] = {0};
+// Decodes at the largest 1/2^n scale that gets under THUMB_MAX_W (tjpgd skips
+// the unused DCT coefficients, so this is far cheaper than a full decode) and
+// re-encodes the result.
+static bool capture_sink_thumb(const CaptureFrame* c) {
+  int shift = 1;
+  while (shift < JPG_SCALE_8X && (c->width >> shift) > THUMB_MAX_W) shift++;
+  uint16_t w = c->width >> shift;
+  uint16_t h = c->height >> shift;
   
-  if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) {
-    return httpd_resp_send_404(req);
-  }
+  size_t rgb_len = (size_t)w * h * 2;
+  uint8_t* rgb = (uint8_t*)(psramFound() ? ps_malloc(rgb_len) : malloc(rgb_len));
+  if (!rgb) return false;
   
-  if (httpd_query_key_value(query, "file", filepath, sizeof(filepath)) != ESP_OK) {
-    return httpd_resp_send_404(req);
-  }
+  uint8_t* jpg = nullptr;
+  size_t jpg_len = 0;
+  bool ok = jpg2rgb565(c->buf, c->len, rgb, (jpg_scale_t)shift) &&
+            fmt2jpg(rgb, rgb_len, w, h, PIXFORMAT_RGB565, THUMB_QUALITY, &jpg, &jpg_len);
+  free(rgb);
   
-  char decoded[96];
-  int di = 0;
-  for (int i = 0; filepath[i] && di < 95; i++) {
-    if (filepath[i] == '%' && filepath[i+1] && filepath[i+2]) {
-      char hex[3] = {filepath[i+1], filepath[i+2], 0};
-      decoded[di++] = (char)strtol(hex, NULL, 16);
-      i += 2;
-    } else {
-      decoded[di++] = filepath[i];
-    }
+  if (ok) {
+    char path[40];
+    snprintf(path, sizeof(path), "/thumbs/%s", c->path + strlen("/photos/"));
+    ok = write_sd_file(path, jpg, jpg_len);
   }
-  decoded[di] = 0;
-  
-  bool success = SD_MMC.remove(decoded);
-  log_pushf("[sd] delete %s: %s", decoded, success ? "OK" : "FAIL");
+  free(jpg);
+  return ok;
+}
+
+static bool capture_sink_journal(const CaptureFrame* c) {
+  bool fresh = !SD_MMC.exists(CAP_JOURNAL_PATH);
+  File file = SD_MMC.open(CAP_JOURNAL_PATH, FILE_APPEND);
+  if (!file) return false;
   
-  char response[64];
-  snprintf(response, sizeof(response), "{\"success\":%s}", success ? "true" : "false");
+  if (fresh) file.print("seq,uptime_ms,source,bytes,width,height,sinks,done,path\n");
+  char line[128];
+  snprintf(line, sizeof(line), "%u,%u,%s,%u,%u,%u,%u,%u,%s\n",
+           c->seq, c->captured_ms, c->source, (unsigned)c->len, c->width, c->height,
+           c->sinks, c->done, c->path);
+  size_t n = strlen(line);
+  bool ok = file.write((const uint8_t*)line, n) == n;
+  file.close();
+  return ok;
+}
+
+static void capture_sink_notify(const CaptureFrame* c) {
+  uint8_t msg[12 + sizeof(c->path)];
+  msg[0] = WS_MSG_CAPTURED;
+  msg[1] = c->done;
+  msg[2] = msg[3] = 0;
+  memcpy(msg + 4, &c->seq, 4);
+  uint32_t len = c->len;
+  memcpy(msg + 8, &len, 4);
+  size_t n = strlen(c->path);
+  memcpy(msg + 12, c->path, n);
+  ws_broadcast(msg, 12 + n);
+}
+
+// Journal and notify, once the card writes and the HTTP send (if any) are
+// both over, so they report what actually landed on the card and reached
+// the client.
+static void capture_finish(CaptureFrame* c) {
+  if ((c->sinks & SINK_JOURNAL) && capture_sink_journal(c)) capture_mark(c, SINK_JOURNAL);
+  if (c->sinks & SINK_NOTIFY) {
+    capture_mark(c, SINK_NOTIFY);
+    capture_sink_notify(c);
+  }
   
-  httpd_resp_set_type(req, "application/json");
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  return httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
+  uint32_t ms = millis() - c->captured_ms;
+  if (c->done & SINK_SD) {
+    log_pushf("[cap] #%u saved: %s (%u bytes, sinks 0x%02x/0x%02x, %ums)",
+              c->seq, c->path, c->len, c->done, c->sinks, ms);
+  } else {
+    log_pushf("[cap] #%u sinks 0x%02x/0x%02x (%ums)", c->seq, c->done, c->sinks, ms);
+  }
 }
 
-// ============================ INDEX HTML WITH EYE TRACKING ============================
+static void capture_stage_done(CaptureFrame* c) {
+  portENTER_CRITICAL(&g_cap_mux);
+  bool last = --c->pending == 0;
+  portEXIT_CRITICAL(&g_cap_mux);
+  if (last) capture_finish(c);
+}
 
-static esp_err_t index_handler(httpd_req_t *req) {
-  static const char INDEX_HTML[] PROGMEM = R"HTML(
-<!DOCTYPE html>
-<html>
-<head>
+// Called by the requesting task once the response has gone out (or failed).
+static void capture_http_done(CaptureFrame* c, bool sent) {
+  if (sent) capture_mark(c, SINK_HTTP);
+  if (c->sinks & ~SINK_HTTP) capture_stage_done(c);
+}
+
+// Card writes for one frame at a time. The HTTP send of the same frame runs
+// alongside on the httpd task; a slow client never holds this queue up.
+static void capture_task(void*) {
+  CaptureFrame* c;
+  for (;;) {
+    xQueueReceive(g_cap_queue, &c, portMAX_DELAY);
+    
+    if ((c->sinks & SINK_SD) && write_sd_file(c->path, c->buf, c->len)) capture_mark(c, SINK_SD);
+    if ((c->sinks & SINK_THUMB) && capture_sink_thumb(c)) capture_mark(c, SINK_THUMB);
+    capture_stage_done(c);
+    capture_release(c);
+  }
+}
+
+static void start_capture_pipeline() {
+  g_cap_queue = xQueueCreate(CAP_QUEUE_LEN, sizeof(CaptureFrame*));
+  // Same priority as loop() so thumbnail decoding shares the core with
+  // recording instead of stalling it.
+  xTaskCreatePinnedToCore(capture_task, "capture", 8192, NULL, 1, NULL, 1);
+}
+
+// ============================ WEBSOCKET STREAM ============================
+
+static bool wss_client_remove(int fd) {
+  bool removed = false;
+  portENTER_CRITICAL(&g_ws_mux);
+  for (int i = 0; i < WSS_MAX_CLIENTS; i++) {
+    if (g_wss_clients[i].fd == fd) {
+      g_wss_clients[i].fd = -1;
+      g_wss_client_count--;
+      removed = true;
+    }
+  }
+  portEXIT_CRITICAL(&g_ws_mux);
+  return removed;
+}
+
+// Sends one JPEG as a single WebSocket message split into two fragments, so the
+// header and the frame buffer go out without being copied together.
+static bool wss_send_frame(int fd, const WsFrameHeader* hdr, const camera_fb_t* fb) {
+  if (httpd_ws_get_fd_info(g_httpd, fd) != HTTPD_WS_CLIENT_WEBSOCKET) return false;
+  
+  httpd_ws_frame_t frame = {};
+  frame.fragmented = true;
+  frame.final = false;
+  frame.type = HTTPD_WS_TYPE_BINARY;
+  frame.payload = (uint8_t*)hdr;
+  frame.len = sizeof(*hdr);
+  if (httpd_ws_send_frame_async(g_httpd, fd, &frame) != ESP_OK) return false;
+  
+  frame.final = true;
+  frame.type = HTTPD_WS_TYPE_CONTINUE;
+  frame.payload = fb->buf;
+  frame.len = fb->len;
+  return httpd_ws_send_frame_async(g_httpd, fd, &frame) == ESP_OK;
+}
+
+static bool wss_any_credit() {
+  bool any = false;
+  portENTER_CRITICAL(&g_ws_mux);
+  for (int i = 0; i < WSS_MAX_CLIENTS; i++) {
+    if (g_wss_clients[i].fd >= 0 && g_wss_clients[i].credits > 0) any = true;
+  }
+  portEXIT_CRITICAL(&g_ws_mux);
+  return any;
+}
+
+// One capture loop feeds every /ws/stream client, so extra viewers cost only
+// the socket send. Parks on a task notification while nobody has credit.
+static void ws_stream_task(void*) {
+  uint32_t seq = 0;
+  uint32_t sent = 0;
+  uint32_t last_fps_time = millis();
+  uint32_t fps_frame_count = 0;
+  bool active = false;
+  
+  for (;;) {
+    if (g_wss_client_count == 0) {
+      if (active) {
+        log_pushf("[stream] ws ended after %u frames", sent);
+        active = false;
+      }
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      continue;
+    }
+    
+    if (!active) {
+      active = true;
+      sent = 0;
+      fps_frame_count = 0;
+      last_fps_time = millis();
+      set_stream_mode();
+    }
+    
+    if (!wss_any_credit()) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+      continue;
+    }
+    
+    uint32_t frame_start = millis();
+    camera_fb_t* fb = cam_fb_get();
+    if (!fb) {
+      log_pushf("[stream] ws frame failed");
+      delay(50);
+      continue;
+    }
+    aq_observe(AQ_STREAM, fb->len);
+    
+    WsFrameHeader hdr = {};
+    hdr.op = WS_MSG_FRAME;
+    hdr.seq = seq++;
+    hdr.ts_ms = fb->timestamp.tv_sec * 1000 + fb->timestamp.tv_usec / 1000;
+    hdr.len = fb->len;
+    
+    for (int i = 0; i < WSS_MAX_CLIENTS; i++) {
+      portENTER_CRITICAL(&g_ws_mux);
+      int fd = g_wss_clients[i].fd;
+      bool has_credit = g_wss_clients[i].credits > 0;
+      portEXIT_CRITICAL(&g_ws_mux);
+      if (fd < 0 || !has_credit) continue;
+      
+      if (!wss_send_frame(fd, &hdr, fb)) {
+        if (wss_client_remove(fd)) log_pushf("[stream] ws client %d dropped", fd);
+        continue;
+      }
+      
+      portENTER_CRITICAL(&g_ws_mux);
+      if (g_wss_clients[i].fd == fd && g_wss_clients[i].credits > 0) g_wss_clients[i].credits--;
+      portEXIT_CRITICAL(&g_ws_mux);
+    }
+    
+    cam_fb_return(fb);
+    
+    sent++;
+    fps_frame_count++;
+    
+    uint32_t now = millis();
+    if (now - last_fps_time >= 5000) {
+      float fps = fps_frame_count * 1000.0f / (now - last_fps_time);
+      log_pushf("[stream] ws %u frames, %.1f fps", sent, fps);
+      fps_frame_count = 0;
+      last_fps_time = now;
+    }
+    
+    uint32_t frame_time = millis() - frame_start;
+    if (frame_time < MIN_FRAME_TIME_MS) {
+      delay(MIN_FRAME_TIME_MS - frame_time);
+    }
+  }
+}
+
+static esp_err_t ws_stream_handler(httpd_req_t *req) {
+  int fd = httpd_req_to_sockfd(req);
+  
+  if (req->method == HTTP_GET) {
+    if (g_stream_view.active) {
+      log_pushf("[stream] ws client refused: sensor held by a stream view");
+      return ESP_FAIL;
+    }
+    int slot = -1;
+    portENTER_CRITICAL(&g_ws_mux);
+    for (int i = 0; i < WSS_MAX_CLIENTS; i++) {
+      if (g_wss_clients[i].fd < 0) {
+        slot = i;
+        g_wss_clients[i].fd = fd;
+        g_wss_clients[i].credits = 0;
+        g_wss_client_count++;
+        break;
+      }
+    }
+    portEXIT_CRITICAL(&g_ws_mux);
+    
+    if (slot < 0) {
+      log_pushf("[stream] ws client limit reached");
+      return ESP_FAIL;
+    }
+    log_pushf("[stream] ws client %d connected", fd);
+    xTaskNotifyGive(g_wss_task);
+    return ESP_OK;
+  }
+  
+  uint8_t buf[WS_RX_MAX];
+  httpd_ws_frame_t frame = {};
+  frame.payload = buf;
+  esp_err_t err = httpd_ws_recv_frame(req, &frame, sizeof(buf));
+  if (err != ESP_OK) return err;
+  if (frame.type != HTTPD_WS_TYPE_BINARY || frame.len < 2 || buf[0] != WS_MSG_CREDIT) return ESP_OK;
+  
+  portENTER_CRITICAL(&g_ws_mux);
+  for (int i = 0; i < WSS_MAX_CLIENTS; i++) {
+    if (g_wss_clients[i].fd == fd) {
+      uint32_t credits = g_wss_clients[i].credits + buf[1];
+      g_wss_clients[i].credits = credits > WSS_MAX_CREDITS ? WSS_MAX_CREDITS : credits;
+    }
+  }
+  portEXIT_CRITICAL(&g_ws_mux);
+  
+  xTaskNotifyGive(g_wss_task);
+  return ESP_OK;
+}
+
+// httpd leaves closing the socket to us once a close callback is installed.
+static void ws_on_close(httpd_handle_t hd, int sockfd) {
+  if (ws_client_remove(sockfd)) log_pushf("[ws] client %d closed", sockfd);
+  if (wss_client_remove(sockfd)) log_pushf("[stream] ws client %d closed", sockfd);
+  close(sockfd);
+}
+
+static void start_ws_push() {
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) g_ws_clients[i].fd = -1;
+  for (int i = 0; i < WSS_MAX_CLIENTS; i++) g_wss_clients[i].fd = -1;
+  g_ws_send_lock = xSemaphoreCreateMutex();
+  ws_refresh_sd_usage();
+  xTaskCreate(ws_push_task, "ws_push", 4096, NULL, 2, &g_ws_task);
+  xTaskCreate(ws_stream_task, "ws_stream", 4096, NULL, 3, &g_wss_task);
+}
+
+// ============================ SD CARD HANDLERS ============================
+
+// Decodes ?file= into out and checks it names something under the card root.
+// On failure the 404 (missing) or 400 (unsafe path) has already been sent.
+static bool sd_query_path(httpd_req_t* req, const char* query, char* out, size_t out_len) {
+  if (httpd_query_key_value(query, "file", out, out_len) != ESP_OK) {
+    httpd_resp_send_404(req);
+    return false;
+  }
+  url_decode(out);
+  if (out[0] != '/' || strstr(out, "..") || strchr(out, '\\')) {
+    log_pushf("[sd] rejected path: %s", out);
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid path");
+    return false;
+  }
+  return true;
+}
+
+static esp_err_t sd_status_handler(httpd_req_t *req) {
+  char buf[128];
+  
+  if (g_sd_available) {
+    uint64_t total = SD_MMC.totalBytes() / (1024 * 1024);
+    uint64_t used = SD_MMC.usedBytes() / (1024 * 1024);
+    snprintf(buf, sizeof(buf), 
+             "{\"available\":true,\"total_mb\":%llu,\"used_mb\":%llu,\"recording\":%s}",
+             total, used, g_is_recording ? "true" : "false");
+  } else {
+    snprintf(buf, sizeof(buf), "{\"available\":false}");
+  }
+  
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, buf, HTTPD_RESP_USE_STRLEN);
+}
+
+static esp_err_t sd_list_handler(httpd_req_t *req) {
+  if (!g_sd_available) {
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_send(req, "{\"files\":[]}", HTTPD_RESP_USE_STRLEN);
+  }
+  
+  String json = "{\"files\":[";
+  bool first = true;
+  
+  const char* dirs[] = {"/photos", "/videos", "/eyetrack"};
+  const char* types[] = {"photo", "video", "eyetrack"};
+  
+  for (int d = 0; d < 3; d++) {
+    File root = SD_MMC.open(dirs[d]);
+    if (!root) continue;
+    
+    File file = root.openNextFile();
+    while (file) {
+      if (!file.isDirectory()) {
+        if (!first) json += ",";
+        first = false;
+        
+        char entry[128];
+        snprintf(entry, sizeof(entry), 
+                 "{\"name\":\"%s\",\"path\":\"%s/%s\",\"size\":%u,\"type\":\"%s\"}",
+                 file.name(), dirs[d], file.name(), file.size(), types[d]);
+        json += entry;
+      }
+      file = root.openNextFile();
+    }
+    root.close();
+  }
+  
+  json += "]}";
+  
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, json.c_str(), json.length());
+}
+
+// Fills blocks from the card as fast as the sender hands them back.
+static void sd_read_task(void* arg) {
+  SdDownload* dl = (SdDownload*)arg;
+  int idx;
+  
+  while (xQueueReceive(dl->free_q, &idx, portMAX_DELAY) == pdTRUE) {
+    if (dl->abort) break;
+    SdDlBlock& b = dl->blocks[idx];
+    b.len = read(dl->fd, b.buf, SD_DL_BLOCK);
+    xQueueSend(dl->full_q, &idx, portMAX_DELAY);
+    if (b.len <= 0) break;
+  }
+  
+  xTaskNotifyGive(dl->owner);
+  vTaskDelete(NULL);
+}
+
+// Prefer DMA-capable internal RAM: the SDMMC driver reads those in one
+// multi-sector transfer, while PSRAM targets are bounced sector by sector.
+static uint8_t* sd_dl_alloc() {
+  uint8_t* buf = (uint8_t*)heap_caps_malloc(SD_DL_BLOCK, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+  if (!buf) buf = (uint8_t*)heap_caps_malloc(SD_DL_BLOCK, MALLOC_CAP_SPIRAM);
+  return buf;
+}
+
+// Streams fd to the response, overlapping card reads with socket sends.
+// Falls back to a single buffer on this task if the reader can't be set up.
+static esp_err_t sd_send_file(httpd_req_t* req, int fd, size_t* sent) {
+  SdDownload dl = {};
+  dl.fd = fd;
+  dl.owner = xTaskGetCurrentTaskHandle();
+  
+  bool ok = true;
+  for (int i = 0; i < SD_DL_BUFFERS; i++) {
+    dl.blocks[i].buf = sd_dl_alloc();
+    ok = ok && dl.blocks[i].buf;
+  }
+  dl.free_q = xQueueCreate(SD_DL_BUFFERS, sizeof(int));
+  dl.full_q = xQueueCreate(SD_DL_BUFFERS, sizeof(int));
+  ok = ok && dl.free_q && dl.full_q;
+  
+  for (int i = 0; ok && i < SD_DL_BUFFERS; i++) {
+    xQueueSend(dl.free_q, &i, 0);
+  }
+  ok = ok && xTaskCreatePinnedToCore(sd_read_task, "sd_read", 4096, &dl, 5, NULL, 0) == pdPASS;
+  
+  esp_err_t res = ESP_OK;
+  
+  if (!ok) {
+    // Single-buffer path, still in large blocks
+    uint8_t* buf = dl.blocks[0].buf;
+    char small[1024];
+    size_t cap = buf ? SD_DL_BLOCK : sizeof(small);
+    if (!buf) buf = (uint8_t*)small;
+    int n;
+    while ((n = read(fd, buf, cap)) > 0) {
+      if (httpd_resp_send_chunk(req, (const char*)buf, n) != ESP_OK) { res = ESP_FAIL; break; }
+      *sent += n;
+    }
+    if (n < 0) res = ESP_FAIL;
+  } else {
+    int idx;
+    while (xQueueReceive(dl.full_q, &idx, portMAX_DELAY) == pdTRUE) {
+      SdDlBlock& b = dl.blocks[idx];
+      if (b.len <= 0) {
+        if (b.len < 0) res = ESP_FAIL;
+        break;
+      }
+      if (httpd_resp_send_chunk(req, (const char*)b.buf, b.len) != ESP_OK) {
+        res = ESP_FAIL;
+        break;
+      }
+      *sent += b.len;
+      xQueueSend(dl.free_q, &idx, portMAX_DELAY);
+    }
+    
+    // Wake the reader if it is waiting for a block, then wait for it to exit
+    // before the buffers go away.
+    dl.abort = true;
+    int wake = 0;
+    xQueueSend(dl.free_q, &wake, 0);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+  
+  if (dl.free_q) vQueueDelete(dl.free_q);
+  if (dl.full_q) vQueueDelete(dl.full_q);
+  for (int i = 0; i < SD_DL_BUFFERS; i++) {
+    if (dl.blocks[i].buf) heap_caps_free(dl.blocks[i].buf);
+  }
+  return res;
+}
+
+static esp_err_t sd_download_handler(httpd_req_t *req) {
+  char query[128] = {0};
+  char decoded[96];
+  
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) {
+    return httpd_resp_send_404(req);
+  }
+  if (!sd_query_path(req, query, decoded, sizeof(decoded))) return ESP_OK;
+  
+  // Plain POSIX I/O: large reads go from FATFS straight into our block
+  // without passing through the stdio buffer behind File.
+  char fullpath[112];
+  snprintf(fullpath, sizeof(fullpath), "%s%s", SD_MOUNT_POINT, decoded);
+  
+  struct stat st;
+  if (stat(fullpath, &st) != 0 || S_ISDIR(st.st_mode)) {
+    return httpd_resp_send_404(req);
+  }
+  
+  // Files are never rewritten in place, so size + mtime identifies a version
+  char etag[32];
+  snprintf(etag, sizeof(etag), "\"%lx-%lx\"", (unsigned long)st.st_size, (unsigned long)st.st_mtime);
+  
+  char inm[32];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", inm, sizeof(inm)) == ESP_OK && strcmp(inm, etag) == 0) {
+    httpd_resp_set_status(req, "304 Not Modified");
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, NULL, 0);
+  }
+  
+  int fd = open(fullpath, O_RDONLY);
+  if (fd < 0) {
+    return httpd_resp_send_404(req);
+  }
+  
+  const char* name = strrchr(decoded, '/');
+  name = name ? name + 1 : decoded;
+  
+  char length[16];
+  snprintf(length, sizeof(length), "%ld", (long)st.st_size);
+  
+  httpd_resp_set_type(req, "application/octet-stream");
+  
+  char header[128];
+  snprintf(header, sizeof(header), "attachment; filename=\"%s\"", name);
+  httpd_resp_set_hdr(req, "Content-Disposition", header);
+  httpd_resp_set_hdr(req, "X-File-Size", length);
+  httpd_resp_set_hdr(req, "ETag", etag);
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  
+  int64_t t0 = esp_timer_get_time();
+  size_t sent = 0;
+  esp_err_t res = sd_send_file(req, fd, &sent);
+  close(fd);
+  
+  if (res != ESP_OK) {
+    log_pushf("[sd] download %s aborted after %u bytes", name, (unsigned)sent);
+    return ESP_FAIL;
+  }
+  
+  // Gallery thumbnails come through here too; only report real transfers
+  uint32_t ms = (esp_timer_get_time() - t0) / 1000;
+  if (sent >= 256 * 1024) log_pushf("[sd] sent %s %u KB in %u ms (%u KB/s)", name, (unsigned)(sent / 1024), ms,
+            ms ? (unsigned)(sent / ms * 1000 / 1024) : 0);
+  return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static esp_err_t sd_delete_handler(httpd_req_t *req) {
+  char query[128] = {0};
+  char decoded[96];
+  
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) {
+    return httpd_resp_send_404(req);
+  }
+  if (!sd_query_path(req, query, decoded, sizeof(decoded))) return ESP_OK;
+  
+  bool success = SD_MMC.remove(decoded);
+  if (success) g_sd_rev++;
+  if (success && strncmp(decoded, "/photos/", 8) == 0) {
+    char thumb[112];
+    snprintf(thumb, sizeof(thumb), "/thumbs/%s", decoded + 8);
+    if (SD_MMC.exists(thumb)) SD_MMC.remove(thumb);
+  }
+  log_pushf("[sd] delete %s: %s", decoded, success ? "OK" : "FAIL");
+  
+  char response[64];
+  snprintf(response, sizeof(response), "{\"success\":%s}", success ? "true" : "false");
+  
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
+}
+
+// ============================ PLAYBACK ============================
+
+static const uint8_t* find_bytes(const uint8_t* hay, size_t len, const char* needle) {
+  size_t n = strlen(needle);
+  for (size_t i = 0; i + n <= len; i++) {
+    if (hay[i] == (uint8_t)needle[0] && memcmp(hay + i, needle, n) == 0) return hay + i;
+  }
+  return nullptr;
+}
+
+// Slides unparsed data to the front of the window and tops it up from the card.
+static bool mjpeg_fill(MjpegReader& r) {
+  if (r.eof) return false;
+  if (r.pos > 0) {
+    memmove(r.buf, r.buf + r.pos, r.end - r.pos);
+    r.end -= r.pos;
+    r.pos = 0;
+  }
+  if (r.end == r.cap) return false;
+  size_t n = r.file.read(r.buf + r.end, r.cap - r.end);
+  if (n == 0) r.eof = true;
+  r.end += n;
+  return n > 0;
+}
+
+// Returns the next frame in the window; valid until the following call.
+// *ts_ms is -1 when the part has no timestamp (older recordings).
+static bool mjpeg_next(MjpegReader& r, const uint8_t** jpeg, size_t* len, int32_t* ts_ms) {
+  const uint8_t* hdr_end;
+  while (!(hdr_end = find_bytes(r.buf + r.pos, r.end - r.pos, "\r\n\r\n"))) {
+    if (!mjpeg_fill(r)) return false;
+  }
+  
+  const uint8_t* part = r.buf + r.pos;
+  size_t hdr_len = hdr_end + 4 - part;
+  
+  // Header lines are ASCII; copy them out so they can be parsed as a string
+  char hdr[160];
+  size_t hn = hdr_len < sizeof(hdr) - 1 ? hdr_len : sizeof(hdr) - 1;
+  memcpy(hdr, part, hn);
+  hdr[hn] = 0;
+  
+  long content_len = -1;
+  *ts_ms = -1;
+  const char* h;
+  if ((h = strstr(hdr, "Content-Length:"))) content_len = strtol(h + 15, NULL, 10);
+  if ((h = strstr(hdr, "X-Timestamp:"))) *ts_ms = strtol(h + 12, NULL, 10);
+  
+  size_t body = r.pos + hdr_len;
+  if (content_len >= 0) {
+    if ((size_t)content_len + hdr_len + 2 > r.cap) return false;
+    while (r.end - r.pos < hdr_len + content_len) {
+      if (!mjpeg_fill(r)) return false;
+      body = r.pos + hdr_len;
+    }
+    *jpeg = r.buf + body;
+    *len = content_len;
+    r.pos = body + content_len;
+  } else {
+    // Older recordings: the frame runs until the next boundary
+    const uint8_t* next;
+    while (!(next = find_bytes(r.buf + body, r.end - body, "\r\n--frame"))) {
+      if (r.eof || (r.pos == 0 && r.end == r.cap)) break;
+      mjpeg_fill(r);
+      body = r.pos + hdr_len;
+    }
+    *jpeg = r.buf + body;
+    *len = next ? (size_t)(next - *jpeg) : r.end - body;
+    while (!next && *len > 0 && ((*jpeg)[*len - 1] == '\r' || (*jpeg)[*len - 1] == '\n')) (*len)--;
+    if (*len == 0) return false;
+    r.pos = body + *len;
+  }
+  
+  // Skip the CRLF that ends each part
+  while (r.pos < r.end && (r.buf[r.pos] == '\r' || r.buf[r.pos] == '\n')) r.pos++;
+  r.frames++;
+  return true;
+}
+
+// GET /sd/play?file=/videos/VID_0001.mjpeg[&speed=2][&offset=30]
+// Streams a recording like /stream, paced by its recorded timestamps.
+// offset is in seconds of recording time; speed is clamped to 0.1..16.
+static esp_err_t sd_play_handler(httpd_req_t *req) {
+  char query[160] = {0};
+  char decoded[96];
+  char val[16];
+  
+  if (!g_sd_available || httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) {
+    return httpd_resp_send_404(req);
+  }
+  if (!sd_query_path(req, query, decoded, sizeof(decoded))) return ESP_OK;
+  
+  float speed = 1.0f;
+  float offset_s = 0;
+  if (httpd_query_key_value(query, "speed", val, sizeof(val)) == ESP_OK) speed = atof(val);
+  if (httpd_query_key_value(query, "offset", val, sizeof(val)) == ESP_OK) offset_s = atof(val);
+  if (speed < 0.1f) speed = 0.1f;
+  if (speed > 16.0f) speed = 16.0f;
+  uint32_t offset_ms = offset_s > 0 ? (uint32_t)(offset_s * 1000) : 0;
+  
+  if (g_is_recording && strcmp(decoded, g_current_video_path) == 0) {
+    httpd_resp_set_status(req, "409 Conflict");
+    return httpd_resp_send(req, "Recording in progress", HTTPD_RESP_USE_STRLEN);
+  }
+  
+  MjpegReader r = {};
+  r.file = SD_MMC.open(decoded);
+  if (!r.file || r.file.isDirectory()) {
+    return httpd_resp_send_404(req);
+  }
+  
+  // Two worst-case frames at the largest size the camera was set up for
+  r.cap = (size_t)resolution[g_cam_init_framesize].width * resolution[g_cam_init_framesize].height / 5 * 2 + 1024;
+  r.buf = (uint8_t*)(psramFound() ? ps_malloc(r.cap) : malloc(r.cap));
+  if (!r.buf) {
+    r.file.close();
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  
+  static const char* STREAM_BOUNDARY = "\r\n--frame\r\n";
+  static const char* STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %u\r\n\r\n";
+  
+  httpd_resp_set_type(req, "multipart/x-mixed-replace;boundary=frame");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  
+  log_pushf("[play] %s speed=%.2f offset=%.1fs", decoded, speed, offset_s);
+  
+  char part_buf[96];
+  const uint8_t* jpeg;
+  size_t len;
+  int32_t ts;
+  int64_t first_ts_ms = -1;
+  uint32_t start = 0;
+  uint32_t sent = 0, dropped = 0;
+  esp_err_t res = ESP_OK;
+  
+  while (mjpeg_next(r, &jpeg, &len, &ts)) {
+    uint32_t rec_ms = ts >= 0 ? ts : (uint32_t)((r.frames - 1) * 1000 / PLAYBACK_LEGACY_FPS);
+    if (rec_ms < offset_ms) continue;
+    
+    if (first_ts_ms < 0) {
+      first_ts_ms = rec_ms;
+      start = millis();
+    }
+    
+    uint32_t due = start + (uint32_t)((rec_ms - first_ts_ms) / speed);
+    int32_t wait = (int32_t)(due - millis());
+    if (wait > 0) {
+      delay(wait);
+    } else if (-wait > (int32_t)PLAYBACK_MAX_LAG_MS && sent > 0) {
+      // Card or link can't keep up at this speed: drop until back on schedule
+      dropped++;
+      continue;
+    }
+    
+    size_t hlen = snprintf(part_buf, sizeof(part_buf), STREAM_PART, (unsigned)len, rec_ms);
+    if (httpd_resp_send_chunk(req, STREAM_BOUNDARY, strlen(STREAM_BOUNDARY)) != ESP_OK ||
+        httpd_resp_send_chunk(req, part_buf, hlen) != ESP_OK ||
+        httpd_resp_send_chunk(req, (const char*)jpeg, len) != ESP_OK) {
+      res = ESP_FAIL;
+      break;
+    }
+    sent++;
+  }
+  
+  free(r.buf);
+  r.file.close();
+  
+  log_pushf("[play] %s done: %u sent, %u dropped", decoded, sent, dropped);
+  if (res == ESP_OK) httpd_resp_send_chunk(req, NULL, 0);
+  return res;
+}
+
+// ============================ INDEX HTML WITH EYE TRACKING ============================
+
+static esp_err_t index_handler(httpd_req_t *req) {
+  static const char INDEX_HTML[] PROGMEM = R"HTML(
+<!DOCTYPE html>
+<html>
+<head>
 <meta charset="UTF-8">
 <meta name="viewport" content="width=device-width,initial-scale=1">
 <title>Joint_CM_2026 v2.2 - Eye Tracking</title>
@@ -972,7 +3202,7 @@ body{font-family:'Segoe UI',system-ui,sans-serif;background:#0a0a0f;color:#e0e0e
 .card-title{font-size:0.9em;color:#00d4ff;margin-bottom:10px;display:flex;align-items:center;gap:8px}
 .preview-card{position:relative}
 #previewWrap{position:relative;width:100%;aspect-ratio:4/3;background:#000;border-radius:8px;overflow:hidden}
-#previewImg{width:100%;height:100%;object-fit:contain;display:none}
+#previewImg,#previewCanvas{width:100%;height:100%;object-fit:contain;display:none}
 #placeholder{position:absolute;inset:0;display:flex;align-items:center;justify-content:center;color:#555;font-size:0.9em}
 #fpsDisplay{position:absolute;top:8px;right:8px;background:rgba(0,0,0,0.7);padding:4px 8px;border-radius:4px;font-size:0.8em;color:#0f0;display:none}
 #dlBtn{position:absolute;bottom:8px;right:8px;background:#00d4ff;color:#000;border:none;padding:6px 12px;border-radius:4px;cursor:pointer;display:none}
@@ -999,9 +3229,11 @@ body{font-family:'Segoe UI',system-ui,sans-serif;background:#0a0a0f;color:#e0e0e
 .tabs{display:flex;gap:5px;margin-bottom:10px}
 .tab{flex:1;padding:8px;background:#222;border:none;color:#888;cursor:pointer;border-radius:6px}
 .tab.active{background:#00d4ff;color:#000}
-#thumbs{display:grid;grid-template-columns:repeat(auto-fill,minmax(70px,1fr));gap:8px;max-height:200px;overflow-y:auto}
-.thumb{position:relative;aspect-ratio:1;border-radius:6px;overflow:hidden;cursor:pointer}
+#thumbs{position:relative;height:200px;overflow-y:auto}
+#thumbsInner{position:relative}
+.thumb{position:absolute;top:0;left:0;border-radius:6px;overflow:hidden;cursor:pointer;background:#1a1a25}
 .thumb img{width:100%;height:100%;object-fit:cover}
+.thumb img:not([src]){visibility:hidden}
 .thumb .badge{position:absolute;bottom:2px;right:2px;font-size:0.7em}
 .eyetrack-card{border:2px solid #ff6b35}
 .eyetrack-card .card-title{color:#ff6b35}
@@ -1012,8 +3244,9 @@ body{font-family:'Segoe UI',system-ui,sans-serif;background:#0a0a0f;color:#e0e0e
 .eye-status{text-align:center;margin-top:10px;font-size:0.85em}
 .eye-status .looking{color:#0f0;font-weight:bold}
 .eye-status .not-looking{color:#888}
-#gazeIndicator{width:20px;height:20px;border-radius:50%;background:#ff6b35;position:absolute;transform:translate(-50%,-50%);transition:all 0.1s;opacity:0;box-shadow:0 0 10px #ff6b35}
+#gazeIndicator{width:20px;height:20px;border-radius:50%;background:#ff6b35;position:absolute;left:0;top:0;transform:translate(125px,125px) translate(-50%,-50%);transition:transform 0.1s,opacity 0.1s;will-change:transform;opacity:0;box-shadow:0 0 10px #ff6b35}
 #gazeIndicator.active{opacity:1}
+#gazeIndicator.look{background:#0f0;box-shadow:0 0 15px #0f0}
 .eye-data{display:grid;grid-template-columns:1fr 1fr;gap:8px;margin-top:10px;font-size:0.75em}
 .eye-data-item{background:#1a1a25;padding:8px;border-radius:6px;text-align:center}
 .eye-data-item .label{color:#888;display:block;margin-bottom:2px}
@@ -1036,16 +3269,24 @@ body{font-family:'Segoe UI',system-ui,sans-serif;background:#0a0a0f;color:#e0e0e
 .sdFile .name{flex:1;overflow:hidden;text-overflow:ellipsis;white-space:nowrap}
 .sdFile button{background:#333;border:none;padding:4px 8px;border-radius:4px;color:#fff;cursor:pointer}
 .term-header{display:flex;justify-content:space-between;align-items:center}
-#termBox{height:200px;overflow-y:auto;background:#0a0a0f;border-radius:6px;padding:8px;font-family:monospace;font-size:0.75em;line-height:1.4;margin-top:8px}
-#termBox div{padding:1px 0}
+#termBox{height:200px;overflow-y:auto;background:#0a0a0f;border-radius:6px;padding:0 8px;font-family:monospace;font-size:0.75em;margin-top:8px}
+#termSpacer{position:relative}
+#termRows{position:absolute;top:0;left:0;right:0;will-change:transform}
+#termRows div{height:16px;line-height:16px;white-space:pre;overflow:hidden;text-overflow:ellipsis}
+#termRows .t-stream{color:#8f8}
+#termRows .t-rec{color:#ff8}
+#termRows .t-eye{color:#ff6b35}
+#hud{position:fixed;top:8px;left:8px;z-index:10;background:rgba(0,0,0,0.8);border:1px solid #333;border-radius:6px;padding:6px 8px;font-family:monospace;font-size:0.72em;line-height:1.5;color:#0f0;white-space:pre;display:none}
+#hud button{margin-top:4px;background:#333;border:none;padding:2px 8px;border-radius:4px;color:#fff;cursor:pointer}
 @media(max-width:900px){.main-grid{grid-template-columns:1fr}.right-col{order:-1}}
 </style>
 </head>
 <body>
 <div class="header">
 <h1>Joint_CM_2026</h1>
-<div class="ver">v2.2 Eye Tracking Edition</div>
+<div class="ver">v2.2 Eye Tracking Edition <button class="btn btn-secondary" id="hudBtn" style="padding:2px 8px;font-size:0.9em">HUD</button></div>
 </div>
+<div id="hud"><div id="hudText"></div><button id="hudCsv">CSV</button></div>
 <div class="main-grid">
 <div class="left-col">
 <div class="card eyetrack-card">
@@ -1065,10 +3306,12 @@ body{font-family:'Segoe UI',system-ui,sans-serif;background:#0a0a0f;color:#e0e0e
 <div class="eye-data-item"><span class="label">Right Eye</span><span class="value" id="rightEyePos">--</span></div>
 <div class="eye-data-item"><span class="label">Gaze Direction</span><span class="value" id="gazeDir">--</span></div>
 <div class="eye-data-item"><span class="label">Confidence</span><span class="value" id="gazeConf">--</span></div>
+<div class="eye-data-item" style="grid-column:span 2"><span class="label">Detector</span><span class="value" id="detectInfo">--</span></div>
 </div>
 <div class="prob-slider">
 <label>Capture Probability when Looking: <span id="probVal">50%</span></label>
 <input type="range" id="probSlider" min="0" max="100" value="50">
+<label style="margin-top:8px">Detection rate: <select id="detectHz"><option>2</option><option>5</option><option selected>10</option><option>15</option><option>30</option></select> Hz</label>
 </div>
 <div class="eyetrack-stats">
 <div class="stat-box"><div class="num" id="triggerCount">0</div><div class="lbl">Triggers</div></div>
@@ -1087,6 +3330,7 @@ body{font-family:'Segoe UI',system-ui,sans-serif;background:#0a0a0f;color:#e0e0e
 </div>
 <div id="previewWrap" class="idle">
 <img id="previewImg">
+<canvas id="previewCanvas"></canvas>
 <div id="placeholder">Click Stream or Capture</div>
 <div id="fpsDisplay">-- fps</div>
 <button id="dlBtn">Download</button>
@@ -1094,9 +3338,11 @@ body{font-family:'Segoe UI',system-ui,sans-serif;background:#0a0a0f;color:#e0e0e
 <div class="controls">
 <button class="btn btn-primary" id="captureBtn">Capture</button>
 <button class="btn btn-secondary" id="startBtn">Stream</button>
+<button class="btn btn-secondary" id="wsStreamBtn">WS Stream</button>
 <button class="btn btn-danger" id="stopBtn" disabled>Stop</button>
 <button class="btn btn-secondary" id="flashOn">Flash On</button>
 <button class="btn btn-secondary" id="flashOff">Flash Off</button>
+<label class="btn btn-secondary"><input type="checkbox" id="saveSd"> Save to SD</label>
 </div>
 <div class="status-bar">
 <span class="status-pill ok" id="sdPill">SD</span>
@@ -1113,7 +3359,7 @@ body{font-family:'Segoe UI',system-ui,sans-serif;background:#0a0a0f;color:#e0e0e
 <button class="tab" data-tab="sd">SD Card</button>
 <button class="tab" data-tab="eye">EyeTrack</button>
 </div>
-<div id="thumbs"></div>
+<div id="thumbs"><div id="thumbsInner"></div></div>
 <div class="controls" style="margin-top:10px">
 <button class="btn btn-secondary" id="clearBtn">Clear</button>
 <button class="btn btn-secondary" id="refreshBtn">Refresh</button>
@@ -1135,66 +3381,260 @@ body{font-family:'Segoe UI',system-ui,sans-serif;background:#0a0a0f;color:#e0e0e
 <div class="card-title" style="margin:0">Terminal <span class="status-pill" id="termPill">Offline</span></div>
 <button class="btn btn-secondary" id="termClear" style="padding:4px 8px;font-size:0.75em">Clear</button>
 </div>
-<div id="termBox"></div>
+<div id="termBox"><div id="termSpacer"><div id="termRows"></div></div></div>
 </div>
 </div>
 </div>
-<script src="https://cdn.jsdelivr.net/npm/@tensorflow/tfjs@4.10.0/dist/tf.min.js"></script>
-<script src="https://cdn.jsdelivr.net/npm/@tensorflow-models/face-landmarks-detection@1.0.5/dist/face-landmarks-detection.min.js"></script>
 <script>
 const $=id=>document.getElementById(id);
 let mode='photo',streaming=false,tab='mem',memGal=[],sdGal=[],curBlob=null,frameCount=0,lastFpsTime=0;
-let eyetrackActive=false,detector=null,webcamStream=null,captureProb=0.5,lastCaptureTime=0,captureCooldown=3000,triggerCount=0,captureCount=0;
-const LEFT_IRIS=[468,469,470,471,472],RIGHT_IRIS=[473,474,475,476,477];
-const LEFT_EYE=[33,7,163,144,145,153,154,155,133,173,157,158,159,160,161,246];
-const RIGHT_EYE=[362,382,381,380,374,373,390,249,263,466,388,387,386,385,384,398];
+let ws=null,wsReady=false,wsEverOpen=false,sdRev=-1;
+const WS_TRIGGER=1,WS_FLASH=2,WS_STATUS=3,WS_LOG=4,WS_CAPTURED=5,WS_PING=6,WS_CREDIT=0x10,WS_FRAME=0x11,WS_STREAM_CREDITS=2;
+let vws=null,vwsNextSeq=-1,vwsSkipped=0;
+let eyetrackActive=false,eyeWorker=null,workerReady=false,workerBusy=false,webcamStream=null,captureProb=0.5,lastCaptureTime=0,captureCooldown=3000,triggerCount=0,captureCount=0;
+// Overlay points posted back by the worker: x,y pairs for each group in order
+const PT_GROUPS=[[0,16,'line'],[16,16,'line'],[32,5,'dot'],[37,5,'dot']];
+// Detection scheduler: runs at detectHz, steps the input scale down when
+// inference eats most of the frame budget and back up when there is slack,
+// crops to the last face box, and idles towards 1 Hz while no face is seen.
+const DETECT_SCALES=[1,0.75,0.5,0.35],FACE_CROP=1.8,IDLE_AFTER_MISSES=5,IDLE_MAX_MS=1000;
+const BACKEND_KEY='eyeBackend';
+let detectHz=10,detectScale=0,inferMs=0,faceBox=null,missCount=0,slowCount=0,fastCount=0,lastDetectStart=0;
 
 function setStatus(t){$('statusText').textContent=t;}
-function showImg(src,label,blob){const img=$('previewImg');img.src=src;img.style.display='block';$('placeholder').style.display='none';$('previewWrap').classList.remove('idle');if(blob){curBlob=blob;$('dlBtn').style.display='block';}else{curBlob=null;$('dlBtn').style.display='none';}}
-function showIdle(msg){$('previewImg').style.display='none';$('placeholder').style.display='flex';$('placeholder').textContent=msg;$('previewWrap').classList.add('idle');$('fpsDisplay').style.display='none';}
+// owned: src is an object URL the preview is responsible for revoking
+let previewUrl=null;
+function showImg(src,label,blob,owned){if(previewUrl&&previewUrl!==src)URL.revokeObjectURL(previewUrl);previewUrl=owned?src:null;const img=$('previewImg');img.src=src;img.style.display='block';$('placeholder').style.display='none';$('previewWrap').classList.remove('idle');if(blob){curBlob=blob;$('dlBtn').style.display='block';}else{curBlob=null;$('dlBtn').style.display='none';}}
+function showIdle(msg){$('previewImg').style.display='none';$('previewCanvas').style.display='none';$('placeholder').style.display='flex';$('placeholder').textContent=msg;$('previewWrap').classList.add('idle');$('fpsDisplay').style.display='none';}
 function setMode(m){mode=m;document.querySelectorAll('.mode-btn').forEach(b=>b.classList.remove('active'));$(m+'Btn').classList.add('active');showIdle(m==='photo'?'Photo mode ready':'Video mode ready');setStatus(m+' ready');}
 
+// Virtualized gallery: only tiles in (or one row around) the viewport exist,
+// keyed by item so refreshes move nodes instead of rebuilding them. Images
+// load when a tile becomes visible, at most THUMB_LOADS at a time.
+const TILE_MIN=70,TILE_GAP=8,TILE_OVERSCAN=1,THUMB_LOADS=3;
+let galItems=[],galNodes=new Map(),galRaf=0,thumbQueue=[],thumbActive=0,thumbObs=null;
+const galKey=it=>it.type==='mem'?it.key:it.path;
+
+// Media cache: SD files keyed by path|size, and this session's captures keyed
+// mem:<n>, live in IndexedDB (an in-memory Map if IndexedDB is unavailable).
+// SD files can be fetched again, so only they are evicted under the LRU byte
+// budget; mem: blobs exist nowhere else and are bounded by MEM_GAL_MAX alone.
+// Object URLs are created per use and revoked when the tile, preview or
+// download is done with them.
+const MEDIA_BUDGET=48*1024*1024,MEDIA_MEM_BUDGET=8*1024*1024,MEDIA_MAX_ITEM=MEDIA_BUDGET/4,MEM_GAL_MAX=200;
+let mediaDb=null,mediaMemBytes=0,memSeq=0;const mediaMem=new Map();
+const isMemKey=k=>k.startsWith('mem:');
+const idbReq=r=>new Promise((res,rej)=>{r.onsuccess=()=>res(r.result);r.onerror=()=>rej(r.error);});
+const mediaReady=(async()=>{
+  try{
+    const r=indexedDB.open('jcm-media',1);
+    r.onupgradeneeded=()=>r.result.createObjectStore('media',{keyPath:'key'}).createIndex('atime','atime');
+    mediaDb=await idbReq(r);
+    // Last session's memory gallery is gone; drop its blobs
+    mediaDb.transaction('media','readwrite').objectStore('media').delete(IDBKeyRange.bound('mem:','mem:\uffff'));
+  }catch(e){mediaDb=null;console.warn('IndexedDB unavailable, caching media in memory');}
+})();
+
+async function mediaGet(key){
+  await mediaReady;
+  if(!mediaDb){const b=mediaMem.get(key);if(b){mediaMem.delete(key);mediaMem.set(key,b);}return b||null;}
+  try{
+    const st=mediaDb.transaction('media','readwrite').objectStore('media');
+    const rec=await idbReq(st.get(key));if(!rec)return null;
+    rec.atime=Date.now();st.put(rec);return rec.blob;
+  }catch(e){return null;}
+}
+
+async function mediaPut(key,blob){
+  await mediaReady;
+  if(!mediaDb){
+    // mediaMemBytes counts SD entries only
+    const mem=isMemKey(key);if(!mem&&blob.size>MEDIA_MEM_BUDGET)return;
+    const old=mediaMem.get(key);if(old){mediaMem.delete(key);if(!mem)mediaMemBytes-=old.size;}
+    mediaMem.set(key,blob);if(!mem)mediaMemBytes+=blob.size;
+    for(const[k,b]of mediaMem){if(mediaMemBytes<=MEDIA_MEM_BUDGET)break;if(isMemKey(k))continue;mediaMem.delete(k);mediaMemBytes-=b.size;}
+    return;
+  }
+  try{
+    const st=mediaDb.transaction('media','readwrite').objectStore('media');
+    await idbReq(st.put({key,blob,size:blob.size,atime:Date.now()}));
+    // Newest first; everything past the budget goes
+    let total=0;const c=st.index('atime').openCursor(null,'prev');
+    c.onsuccess=()=>{const cur=c.result;if(!cur)return;if(!isMemKey(cur.value.key)){total+=cur.value.size;if(total>MEDIA_BUDGET)cur.delete();}cur.continue();};
+  }catch(e){console.warn('Media cache write failed:',e);}
+}
+
+function mediaDelete(key){
+  if(!mediaDb){const b=mediaMem.get(key);if(b){mediaMem.delete(key);if(!isMemKey(key))mediaMemBytes-=b.size;}return;}
+  try{mediaDb.transaction('media','readwrite').objectStore('media').delete(key);}catch(e){}
+}
+
+async function mediaFetch(path,size,signal){
+  const key=`${path}|${size}`;
+  let blob=await mediaGet(key);if(blob)return blob;
+  const r=await fetch(`/sd/download?file=${encodeURIComponent(path)}`,{signal});
+  if(!r.ok)throw new Error('HTTP '+r.status);
+  blob=await r.blob();
+  if(blob.size<=MEDIA_MAX_ITEM)mediaPut(key,blob);
+  return blob;
+}
+
+async function downloadItem(f){
+  // Big recordings go straight to the browser's downloader, not through memory
+  if(f.size>MEDIA_MAX_ITEM){window.open(`/sd/download?file=${encodeURIComponent(f.path)}`);return;}
+  try{const blob=await mediaFetch(f.path,f.size);saveBlob(blob,f.name);}
+  catch(e){console.error('Download failed:',e);setStatus('Download failed');}
+}
+
+function saveBlob(blob,name){const a=document.createElement('a');a.href=URL.createObjectURL(blob);a.download=name;a.click();setTimeout(()=>URL.revokeObjectURL(a.href),1000);}
+
 function updateGal(){
   let items;
   if(tab==='mem')items=memGal;
   else if(tab==='sd')items=sdGal.filter(x=>x.type!=='eyetrack');
   else items=sdGal.filter(x=>x.type==='eyetrack');
   $('galCount').textContent=items.length;
-  $('thumbs').innerHTML='';
-  items.forEach(it=>{
-    const d=document.createElement('div');d.className='thumb';
-    const img=document.createElement('img');
-    img.src=it.type==='mem'?it.url:`/sd/download?file=${encodeURIComponent(it.path)}`;
-    img.onclick=()=>{if(it.type==='mem')showImg(it.url,'Photo',it.blob);else window.open(`/sd/download?file=${encodeURIComponent(it.path)}`);};
-    const badge=document.createElement('div');badge.className='badge';
-    badge.textContent=it.isVideo?'Vid':(it.type==='eyetrack'?'Eye':'Pic');
-    d.appendChild(img);d.appendChild(badge);$('thumbs').prepend(d);
-  });
+  galItems=items.slice().reverse();
+  renderGal();
+}
+
+function renderGal(){
+  galRaf=0;
+  const box=$('thumbs'),inner=$('thumbsInner');
+  const w=box.clientWidth||TILE_MIN;
+  const cols=Math.max(1,Math.floor((w+TILE_GAP)/(TILE_MIN+TILE_GAP)));
+  const size=Math.floor((w-(cols-1)*TILE_GAP)/cols),pitch=size+TILE_GAP;
+  const rows=Math.ceil(galItems.length/cols);
+  const h=Math.max(0,rows*pitch-TILE_GAP)+'px';
+  if(inner.style.height!==h)inner.style.height=h;
+  const first=Math.max(0,Math.floor(box.scrollTop/pitch)-TILE_OVERSCAN);
+  const last=Math.min(rows-1,Math.floor((box.scrollTop+box.clientHeight)/pitch)+TILE_OVERSCAN);
+  const keep=new Set();
+  for(let i=first*cols;i<Math.min(galItems.length,(last+1)*cols);i++){
+    const it=galItems[i],key=galKey(it);keep.add(key);
+    let d=galNodes.get(key);
+    if(!d){d=makeThumb(it);galNodes.set(key,d);inner.appendChild(d);}
+    const pos=`translate(${(i%cols)*pitch}px,${Math.floor(i/cols)*pitch}px)`;
+    if(d._pos!==pos){d._pos=pos;d.style.transform=pos;}
+    if(d._size!==size){d._size=size;d.style.width=d.style.height=size+'px';}
+  }
+  for(const[key,d]of galNodes)if(!keep.has(key)){dropThumb(d);galNodes.delete(key);}
+}
+
+function makeThumb(it){
+  const d=document.createElement('div');d.className='thumb';d._item=it;d._state='idle';
+  const img=document.createElement('img');
+  d.onclick=async()=>{
+    if(it.type==='mem'){const b=await mediaGet(it.key);if(b)showImg(URL.createObjectURL(b),'Photo',b,true);}
+    else downloadItem(it);
+  };
+  const badge=document.createElement('div');badge.className='badge';
+  badge.textContent=it.isVideo?'Vid':(it.type==='eyetrack'?'Eye':'Pic');
+  d.appendChild(img);d.appendChild(badge);
+  // Recordings aren't displayable images; don't pull whole videos for a tile
+  if(!it.isVideo)thumbObs.observe(d);
+  return d;
+}
+
+function dropThumb(d){
+  thumbObs.unobserve(d);
+  const q=thumbQueue.indexOf(d);if(q>=0)thumbQueue.splice(q,1);
+  if(d._state==='loading'){const img=d.firstChild;img.onload=img.onerror=null;img.removeAttribute('src');if(d._abort)d._abort.abort();thumbActive--;pumpThumbs();}
+  if(d._url)URL.revokeObjectURL(d._url);
+  d._state='dropped';d.remove();
+}
+
+function pumpThumbs(){
+  while(thumbActive<THUMB_LOADS&&thumbQueue.length){
+    const d=thumbQueue.shift(),img=d.firstChild,it=d._item;
+    d._state='loading';thumbActive++;d._abort=new AbortController();
+    const done=()=>{img.onload=img.onerror=null;d._state='done';d._abort=null;thumbActive--;pumpThumbs();};
+    (it.type==='mem'?mediaGet(it.key):mediaFetch(it.path,it.size,d._abort.signal)).then(blob=>{
+      if(d._state!=='loading')return;
+      if(!blob){done();return;}
+      d._url=URL.createObjectURL(blob);img.onload=img.onerror=done;img.src=d._url;
+    }).catch(()=>{if(d._state==='loading')done();});
+  }
+}
+
+function initGal(){
+  thumbObs=new IntersectionObserver(entries=>{
+    for(const e of entries){
+      const d=e.target;
+      if(e.isIntersecting){if(d._state==='idle'){d._state='queued';thumbQueue.push(d);}}
+      else if(d._state==='queued'){d._state='idle';thumbQueue.splice(thumbQueue.indexOf(d),1);}
+    }
+    pumpThumbs();
+  },{root:$('thumbs')});
+  $('thumbs').addEventListener('scroll',()=>{if(!galRaf)galRaf=requestAnimationFrame(renderGal);},{passive:true});
+  new ResizeObserver(()=>{if(!galRaf)galRaf=requestAnimationFrame(renderGal);}).observe($('thumbs'));
 }
 
-function addMem(blob){const url=URL.createObjectURL(blob);memGal.push({type:'mem',url,blob,size:blob.size});if(tab==='mem')updateGal();}
+function addMem(blob){
+  const key='mem:'+(++memSeq);mediaPut(key,blob);memGal.push({type:'mem',key,size:blob.size});
+  while(memGal.length>MEM_GAL_MAX)mediaDelete(memGal.shift().key);
+  if(tab==='mem')updateGal();
+}
 
 async function capture(){
   setStatus('Capturing...');$('placeholder').textContent='Capturing...';$('previewImg').style.display='none';$('placeholder').style.display='flex';
-  try{const r=await fetch('/capture?t='+Date.now(),{cache:'no-store'});if(!r.ok)throw 0;const blob=await r.blob();const url=URL.createObjectURL(blob);showImg(url,'Photo',blob);setStatus('Captured');addMem(blob);}
+  // One exposure serves both the preview and the SD copy
+  const sinks=$('saveSd').checked?'&sinks=http,sd,thumb,journal,notify':'';
+  try{const r=await fetch('/capture?t='+Date.now()+sinks,{cache:'no-store'});if(!r.ok)throw 0;const blob=await r.blob();const url=URL.createObjectURL(blob);showImg(url,'Photo',blob,true);setStatus('Captured');addMem(blob);}
   catch(e){showIdle('Capture failed');setStatus('Error');}
 }
 
-function startStream(){setStatus('Streaming...');streaming=true;$('startBtn').disabled=true;$('stopBtn').disabled=false;$('dlBtn').style.display='none';$('fpsDisplay').style.display='block';frameCount=0;lastFpsTime=Date.now();const img=$('previewImg');img.onload=()=>{frameCount++;const now=Date.now();if(now-lastFpsTime>=1000){const fps=frameCount*1000/(now-lastFpsTime);$('fpsDisplay').textContent=fps.toFixed(1)+' fps';frameCount=0;lastFpsTime=now;}};showImg('/stream?'+Date.now(),'Live');}
-function stopStream(){streaming=false;$('startBtn').disabled=false;$('stopBtn').disabled=true;$('previewImg').onload=null;$('previewImg').src='';setTimeout(()=>showIdle('Stopped'),100);setStatus('Stopped');}
-async function flash(on){setStatus(on?'Flash on':'Flash off');try{await fetch('/flash?on='+(on?'1':'0'))}catch{}}
-function clearGal(){if(tab==='mem'){memGal.forEach(x=>URL.revokeObjectURL(x.url));memGal=[];}updateGal();setStatus('Cleared');}
+function startStream(){setStatus('Streaming...');streaming=true;$('startBtn').disabled=true;$('wsStreamBtn').disabled=true;$('stopBtn').disabled=false;$('dlBtn').style.display='none';$('fpsDisplay').style.display='block';frameCount=0;lastFpsTime=Date.now();const img=$('previewImg');img.onload=()=>{perfFrame();frameCount++;const now=Date.now();if(now-lastFpsTime>=1000){const fps=frameCount*1000/(now-lastFpsTime);$('fpsDisplay').textContent=fps.toFixed(1)+' fps';frameCount=0;lastFpsTime=now;}};showImg('/stream?'+Date.now(),'Live');}
+function startWsStream(){
+  setStatus('Streaming (WS)...');streaming=true;$('startBtn').disabled=true;$('wsStreamBtn').disabled=true;$('stopBtn').disabled=false;$('dlBtn').style.display='none';$('fpsDisplay').style.display='block';
+  frameCount=0;lastFpsTime=Date.now();vwsNextSeq=-1;vwsSkipped=0;
+  const cv=$('previewCanvas'),ctx=cv.getContext('2d');
+  const sock=new WebSocket(`ws://${location.host}/ws/stream`);sock.binaryType='arraybuffer';vws=sock;
+  sock.onopen=()=>sock.send(Uint8Array.of(WS_CREDIT,WS_STREAM_CREDITS));
+  sock.onclose=()=>{if(vws===sock){vws=null;if(streaming)stopStream();}};
+  sock.onmessage=async e=>{
+    if(!(e.data instanceof ArrayBuffer)||e.data.byteLength<16)return;
+    const v=new DataView(e.data);if(v.getUint8(0)!==WS_FRAME)return;
+    const seq=v.getUint32(4,true),len=v.getUint32(12,true);
+    if(vwsNextSeq>=0&&seq>vwsNextSeq)vwsSkipped+=seq-vwsNextSeq;vwsNextSeq=seq+1;
+    try{
+      const bmp=await createImageBitmap(new Blob([new Uint8Array(e.data,16,len)],{type:'image/jpeg'}));
+      if(vws!==sock){bmp.close();return;}
+      if(cv.width!==bmp.width||cv.height!==bmp.height){cv.width=bmp.width;cv.height=bmp.height;}
+      ctx.drawImage(bmp,0,0);bmp.close();
+      if(cv.style.display!=='block'){cv.style.display='block';$('placeholder').style.display='none';$('previewWrap').classList.remove('idle');}
+      perfFrame();frameCount++;const now=Date.now();if(now-lastFpsTime>=1000){const fps=frameCount*1000/(now-lastFpsTime);$('fpsDisplay').textContent=fps.toFixed(1)+' fps'+(vwsSkipped?` (${vwsSkipped} skip)`:'');frameCount=0;lastFpsTime=now;}
+    }catch(err){console.error('Frame decode failed:',err);}
+    if(sock.readyState===1)sock.send(Uint8Array.of(WS_CREDIT,1));
+  };
+}
+function stopStream(){streaming=false;if(vws){const s=vws;vws=null;s.close();}$('startBtn').disabled=false;$('wsStreamBtn').disabled=false;$('stopBtn').disabled=true;$('previewImg').onload=null;$('previewImg').src='';setTimeout(()=>showIdle('Stopped'),100);setStatus('Stopped');}
+async function flash(on){setStatus(on?'Flash on':'Flash off');if(wsReady){ws.send(Uint8Array.of(WS_FLASH,on?1:0));return;}try{await fetch('/flash?on='+(on?'1':'0'))}catch{}}
+function clearGal(){if(tab==='mem'){memGal.forEach(x=>mediaDelete(x.key));memGal=[];}updateGal();setStatus('Cleared');}
 
 async function loadSD(){
   try{const r=await fetch('/sd/status');const d=await r.json();if(d.available){$('sdPill').textContent='OK';$('sdStatus').textContent=`${d.used_mb}/${d.total_mb}MB`;$('sdBar').style.width=(d.used_mb/d.total_mb*100)+'%';$('recPill').style.display=d.recording?'inline-block':'none';}else{$('sdPill').textContent='No Card';$('sdStatus').textContent='Not available';}}catch{$('sdPill').textContent='Error';}
-  try{const r=await fetch('/sd/list');const d=await r.json();sdGal=(d.files||[]).map(f=>({type:f.type,name:f.name,path:f.path,size:f.size,isVideo:f.type==='video'}));$('sdFiles').innerHTML='';sdGal.slice().reverse().forEach(f=>{const div=document.createElement('div');div.className='sdFile';const icon=f.isVideo?'Vid':(f.type==='eyetrack'?'Eye':'Pic');div.innerHTML=`<span>${icon}</span><span class="name">${f.name}</span><button onclick="window.open('/sd/download?file=${encodeURIComponent(f.path)}')">DL</button>`;$('sdFiles').appendChild(div);});if(tab!=='mem')updateGal();}catch{}
+  await loadSDList();
   try{const r=await fetch('/eyetrack/stats');const d=await r.json();$('triggerCount').textContent=d.triggers||0;$('captureCount').textContent=d.captures||0;triggerCount=d.triggers||0;captureCount=d.captures||0;}catch{}
 }
 
-async function initEyeTracking(){
+async function loadSDList(){
+  try{const r=await fetch('/sd/list');const d=await r.json();sdGal=(d.files||[]).map(f=>({type:f.type,name:f.name,path:f.path,size:f.size,isVideo:f.type==='video'}));$('sdFiles').innerHTML='';sdGal.slice().reverse().forEach(f=>{const div=document.createElement('div');div.className='sdFile';const icon=f.isVideo?'Vid':(f.type==='eyetrack'?'Eye':'Pic');div.innerHTML=`<span>${icon}</span><span class="name">${f.name}</span>${f.isVideo?`<button onclick="window.open('/sd/play?file=${encodeURIComponent(f.path)}')">Play</button>`:''}<button class="dl">DL</button>`;div.querySelector('.dl').onclick=()=>downloadItem(f);$('sdFiles').appendChild(div);});if(tab!=='mem')updateGal();}catch{}
+}
+
+function initEyeTracking(){
   $('eyeStatusText').textContent='Loading TensorFlow.js model...';
-  try{const model=faceLandmarksDetection.SupportedModels.MediaPipeFaceMesh;const detectorConfig={runtime:'tfjs',refineLandmarks:true,maxFaces:1};detector=await faceLandmarksDetection.createDetector(model,detectorConfig);console.log('Face mesh model loaded');$('eyeStatusText').textContent='Model loaded. Click Start.';}
-  catch(e){console.error('Failed to load model:',e);$('eyeStatusText').textContent='Failed to load model: '+e.message;}
+  try{eyeWorker=new Worker('/eyeworker.js');}
+  catch(e){console.error('Worker start failed:',e);$('eyeStatusText').textContent='Eye tracking needs Web Worker support';return;}
+  eyeWorker.onmessage=e=>{
+    const m=e.data;
+    if(m.type==='ready'){workerReady=true;console.log('Face mesh model loaded in worker, backend',m.backend,m.cached?'(saved)':'(benchmark pending)');$('eyeStatusText').textContent='Model loaded. Click Start.';}
+    else if(m.type==='backend'){localStorage.setItem(BACKEND_KEY,m.backend);console.log('TF.js backend benchmark (ms):',m.times,'using',m.backend);inferMs=0;}
+    else if(m.type==='error'){workerBusy=false;console.error('Eye worker:',m.msg);if(!workerReady)$('eyeStatusText').textContent='Failed to load model: '+m.msg;else scheduleDetection();}
+    else if(m.type==='result'){workerBusy=false;if(eyetrackActive){adaptDetection(m);applyGaze(m);scheduleDetection();}}
+  };
+  eyeWorker.onerror=e=>{console.error('Eye worker error:',e.message);$('eyeStatusText').textContent='Failed to load model: '+e.message;};
+  eyeWorker.postMessage({type:'init',backend:localStorage.getItem(BACKEND_KEY)});
 }
 
 async function startWebcam(){
@@ -1204,109 +3644,250 @@ async function startWebcam(){
 
 function stopWebcam(){if(webcamStream){webcamStream.getTracks().forEach(t=>t.stop());webcamStream=null;}$('webcamVideo').srcObject=null;}
 
-function calculateGazeDirection(face){
-  const kp=face.keypoints;
-  const leftIris=kp.filter((_,i)=>LEFT_IRIS.includes(i));
-  const rightIris=kp.filter((_,i)=>RIGHT_IRIS.includes(i));
-  const leftEye=kp.filter((_,i)=>LEFT_EYE.includes(i));
-  const rightEye=kp.filter((_,i)=>RIGHT_EYE.includes(i));
-  if(leftIris.length===0||rightIris.length===0)return null;
-  const leftEyeCenter={x:leftEye.reduce((s,p)=>s+p.x,0)/leftEye.length,y:leftEye.reduce((s,p)=>s+p.y,0)/leftEye.length};
-  const rightEyeCenter={x:rightEye.reduce((s,p)=>s+p.x,0)/rightEye.length,y:rightEye.reduce((s,p)=>s+p.y,0)/rightEye.length};
-  const leftIrisCenter={x:leftIris.reduce((s,p)=>s+p.x,0)/leftIris.length,y:leftIris.reduce((s,p)=>s+p.y,0)/leftIris.length};
-  const rightIrisCenter={x:rightIris.reduce((s,p)=>s+p.x,0)/rightIris.length,y:rightIris.reduce((s,p)=>s+p.y,0)/rightIris.length};
-  const leftEyeWidth=Math.max(...leftEye.map(p=>p.x))-Math.min(...leftEye.map(p=>p.x));
-  const rightEyeWidth=Math.max(...rightEye.map(p=>p.x))-Math.min(...rightEye.map(p=>p.x));
-  const leftGazeX=(leftIrisCenter.x-leftEyeCenter.x)/(leftEyeWidth/2);
-  const rightGazeX=(rightIrisCenter.x-rightEyeCenter.x)/(rightEyeWidth/2);
-  const avgGazeX=(leftGazeX+rightGazeX)/2;
-  const avgGazeY=((leftIrisCenter.y-leftEyeCenter.y)+(rightIrisCenter.y-rightEyeCenter.y))/2;
-  const gazeThreshold=0.3;
-  const isLooking=Math.abs(avgGazeX)<gazeThreshold&&Math.abs(avgGazeY)<20;
-  const confidence=face.box?Math.min(100,Math.round((1-Math.abs(avgGazeX))*100)):0;
-  return{leftIris:leftIrisCenter,rightIris:rightIrisCenter,leftEye:leftEyeCenter,rightEye:rightEyeCenter,gazeX:avgGazeX,gazeY:avgGazeY,isLooking,confidence};
+// Overlay writes avoid forced layout: circle geometry is cached from a
+// ResizeObserver, the indicator moves by transform and changes state by class,
+// and readout text is coalesced and written at most every EYE_TEXT_MS.
+const EYE_TEXT_MS=200;
+let eyeCtx=null,circleW=250,circleH=250,indPos='',eyeTextTimer=0;
+const eyeText={},eyeTextShown={};
+function queueText(id,t){eyeText[id]=t;if(!eyeTextTimer)eyeTextTimer=setTimeout(flushText,EYE_TEXT_MS);}
+function flushText(){eyeTextTimer=0;for(const id in eyeText)if(eyeTextShown[id]!==eyeText[id]){$(id).textContent=eyeTextShown[id]=eyeText[id];}}
+function setEyeStatus(t,cls){const el=$('eyeStatusText');if(el.textContent!==t)el.textContent=t;if(el.className!==cls)el.className=cls;}
+function setIndicator(x,y,active,look){
+  const ind=$('gazeIndicator');
+  if(active){const pos=`translate(${x.toFixed(1)}px,${y.toFixed(1)}px) translate(-50%,-50%)`;if(pos!==indPos){indPos=pos;ind.style.transform=pos;}}
+  ind.classList.toggle('active',active);ind.classList.toggle('look',look);
+}
+function initEyeOverlay(){
+  new ResizeObserver(e=>{circleW=e[0].contentRect.width;circleH=e[0].contentRect.height;}).observe($('eyetrackCircle'));
 }
 
-function drawEyeTracking(face,canvas,video){
-  const ctx=canvas.getContext('2d');
-  const scaleX=canvas.width/video.videoWidth;
-  const scaleY=canvas.height/video.videoHeight;
+function drawEyeTracking(m,canvas){
+  if(canvas.width!==m.w||canvas.height!==m.h){canvas.width=m.w;canvas.height=m.h;}
+  const ctx=eyeCtx||(eyeCtx=canvas.getContext('2d'));
   ctx.clearRect(0,0,canvas.width,canvas.height);
-  if(!face||!face.keypoints)return;
-  ctx.strokeStyle='#00d4ff';ctx.lineWidth=2;
-  const leftEyePoints=face.keypoints.filter((_,i)=>LEFT_EYE.includes(i));
-  const rightEyePoints=face.keypoints.filter((_,i)=>RIGHT_EYE.includes(i));
-  ctx.beginPath();leftEyePoints.forEach((p,i)=>{const x=(video.videoWidth-p.x)*scaleX;const y=p.y*scaleY;if(i===0)ctx.moveTo(x,y);else ctx.lineTo(x,y);});ctx.closePath();ctx.stroke();
-  ctx.beginPath();rightEyePoints.forEach((p,i)=>{const x=(video.videoWidth-p.x)*scaleX;const y=p.y*scaleY;if(i===0)ctx.moveTo(x,y);else ctx.lineTo(x,y);});ctx.closePath();ctx.stroke();
-  ctx.fillStyle='#ff6b35';
-  const leftIris=face.keypoints.filter((_,i)=>LEFT_IRIS.includes(i));
-  const rightIris=face.keypoints.filter((_,i)=>RIGHT_IRIS.includes(i));
-  leftIris.forEach(p=>{const x=(video.videoWidth-p.x)*scaleX;const y=p.y*scaleY;ctx.beginPath();ctx.arc(x,y,3,0,Math.PI*2);ctx.fill();});
-  rightIris.forEach(p=>{const x=(video.videoWidth-p.x)*scaleX;const y=p.y*scaleY;ctx.beginPath();ctx.arc(x,y,3,0,Math.PI*2);ctx.fill();});
+  if(!m.pts)return;
+  const pts=m.pts;
+  ctx.strokeStyle='#00d4ff';ctx.lineWidth=2;ctx.fillStyle='#ff6b35';
+  for(const[start,n,kind]of PT_GROUPS){
+    if(kind==='line'){ctx.beginPath();for(let i=0;i<n;i++){const x=m.w-pts[(start+i)*2],y=pts[(start+i)*2+1];if(i===0)ctx.moveTo(x,y);else ctx.lineTo(x,y);}ctx.closePath();ctx.stroke();}
+    else for(let i=0;i<n;i++){ctx.beginPath();ctx.arc(m.w-pts[(start+i)*2],pts[(start+i)*2+1],3,0,Math.PI*2);ctx.fill();}
+  }
+}
+
+// Trigger policy: gaze is smoothed with a time-based EMA, "looking" is entered
+// and left at separate thresholds, and a gaze episode has to dwell before it
+// fires - once. Short face dropouts don't end an episode.
+const GAZE_TAU_MS=200,GAZE_ENTER_X=0.25,GAZE_ENTER_Y=15,GAZE_EXIT_X=0.35,GAZE_EXIT_Y=25,GAZE_DWELL_MS=500,GAZE_LOST_MS=400;
+const gz={x:0,y:0,t:0,looking:false,since:0,fired:false};
+
+// Returns true when this sample completes a new episode's dwell
+function updateGazePolicy(gaze,now){
+  if(!gaze){if(gz.t&&now-gz.t>GAZE_LOST_MS){gz.t=0;gz.looking=false;}return false;}
+  const a=gz.t?1-Math.exp(-(now-gz.t)/GAZE_TAU_MS):1;
+  gz.x+=a*(gaze.gazeX-gz.x);gz.y+=a*(gaze.gazeY-gz.y);gz.t=now;
+  const ax=Math.abs(gz.x),ay=Math.abs(gz.y);
+  if(!gz.looking){if(ax<GAZE_ENTER_X&&ay<GAZE_ENTER_Y){gz.looking=true;gz.since=now;gz.fired=false;}}
+  else if(ax>GAZE_EXIT_X||ay>GAZE_EXIT_Y)gz.looking=false;
+  if(gz.looking&&!gz.fired&&now-gz.since>=GAZE_DWELL_MS){gz.fired=true;return true;}
+  return false;
 }
 
 async function triggerEyetrackCapture(){
   const now=Date.now();
   if(now-lastCaptureTime<captureCooldown)return;
   if(Math.random()>captureProb){console.log('Gaze detected but random check failed');return;}
-  lastCaptureTime=now;triggerCount++;$('triggerCount').textContent=triggerCount;
+  lastCaptureTime=now;triggerCount++;$('triggerCount').textContent=triggerCount;perf.trigAt=performance.now();
   console.log('Eye track capture triggered!');
-  try{const r=await fetch('/eyetrack/capture?t='+now);const d=await r.json();if(d.success){captureCount++;$('captureCount').textContent=captureCount;console.log('Eye track photo saved:',d.filename);$('eyetrackCircle').style.borderColor='#0f0';setTimeout(()=>{$('eyetrackCircle').style.borderColor='#ff6b35';},200);setTimeout(loadSD,500);}}
+  if(wsReady){ws.send(Uint8Array.of(WS_TRIGGER));return;}
+  try{const r=await fetch('/eyetrack/capture?t='+now);const d=await r.json();perfTrigger();if(d.success){captureCount++;$('captureCount').textContent=captureCount;console.log('Eye track photo saved:',d.filename);$('eyetrackCircle').style.borderColor='#0f0';setTimeout(()=>{$('eyetrackCircle').style.borderColor='#ff6b35';},200);setTimeout(loadSD,500);}}
   catch(e){console.error('Eye track capture failed:',e);}
 }
 
+// Frames go to the worker as transferred ImageBitmaps, one in flight at a
+// time; the page thread only grabs frames and applies results.
 let detectLoop=null;
-async function runDetection(){
-  if(!eyetrackActive||!detector)return;
-  const video=$('webcamVideo');const canvas=$('eyeCanvas');
-  if(video.readyState<2){detectLoop=requestAnimationFrame(runDetection);return;}
-  canvas.width=video.videoWidth;canvas.height=video.videoHeight;
-  try{
-    const faces=await detector.estimateFaces(video);
-    if(faces.length>0){
-      const face=faces[0];const gaze=calculateGazeDirection(face);
-      drawEyeTracking(face,canvas,video);
-      if(gaze){
-        $('leftEyePos').textContent=`(${Math.round(gaze.leftIris.x)}, ${Math.round(gaze.leftIris.y)})`;
-        $('rightEyePos').textContent=`(${Math.round(gaze.rightIris.x)}, ${Math.round(gaze.rightIris.y)})`;
-        $('gazeDir').textContent=`X:${gaze.gazeX.toFixed(2)} Y:${gaze.gazeY.toFixed(2)}`;
-        $('gazeConf').textContent=`${gaze.confidence}%`;
-        const indicator=$('gazeIndicator');const circleRect=$('eyetrackCircle').getBoundingClientRect();
-        const centerX=circleRect.width/2;const centerY=circleRect.height/2;
-        const indicatorX=centerX-gaze.gazeX*60;const indicatorY=centerY+gaze.gazeY*2;
-        indicator.style.left=indicatorX+'px';indicator.style.top=indicatorY+'px';indicator.classList.add('active');
-        if(gaze.isLooking){$('eyeStatusText').textContent='LOOKING AT CAMERA';$('eyeStatusText').className='looking';indicator.style.background='#0f0';indicator.style.boxShadow='0 0 15px #0f0';await triggerEyetrackCapture();}
-        else{$('eyeStatusText').textContent='Looking away...';$('eyeStatusText').className='not-looking';indicator.style.background='#ff6b35';indicator.style.boxShadow='0 0 10px #ff6b35';}
-      }
-    }else{
-      $('eyeStatusText').textContent='No face detected';$('eyeStatusText').className='not-looking';
-      $('leftEyePos').textContent='--';$('rightEyePos').textContent='--';$('gazeDir').textContent='--';$('gazeConf').textContent='--';
-      $('gazeIndicator').classList.remove('active');
-      const ctx=canvas.getContext('2d');ctx.clearRect(0,0,canvas.width,canvas.height);
-    }
-  }catch(e){console.error('Detection error:',e);}
-  detectLoop=requestAnimationFrame(runDetection);
+function scheduleDetection(){
+  if(!eyetrackActive||detectLoop)return;
+  let period=1000/detectHz;
+  if(missCount>IDLE_AFTER_MISSES)period=Math.min(IDLE_MAX_MS,period*(1+(missCount-IDLE_AFTER_MISSES)/IDLE_AFTER_MISSES));
+  detectLoop=setTimeout(runDetection,Math.max(0,lastDetectStart+period-performance.now()));
+}
+
+function runDetection(){
+  detectLoop=null;
+  if(!eyetrackActive||!workerReady||workerBusy)return;
+  const video=$('webcamVideo');
+  if(video.readyState<2||document.hidden){detectLoop=setTimeout(runDetection,document.hidden?IDLE_MAX_MS:100);return;}
+  lastDetectStart=performance.now();
+  const vw=video.videoWidth,vh=video.videoHeight,k=DETECT_SCALES[detectScale];
+  let sx=0,sy=0,sw=vw,sh=vh;
+  if(faceBox){
+    const side=Math.max(faceBox.w,faceBox.h)*FACE_CROP;
+    sw=Math.min(vw,Math.round(side));sh=Math.min(vh,Math.round(side));
+    sx=Math.round(Math.min(Math.max(0,faceBox.x+faceBox.w/2-sw/2),vw-sw));
+    sy=Math.round(Math.min(Math.max(0,faceBox.y+faceBox.h/2-sh/2),vh-sh));
+  }
+  workerBusy=true;
+  createImageBitmap(video,sx,sy,sw,sh,{resizeWidth:Math.max(1,Math.round(sw*k)),resizeHeight:Math.max(1,Math.round(sh*k)),resizeQuality:'low'})
+    .then(bmp=>{if(!eyetrackActive){bmp.close();workerBusy=false;return;}eyeWorker.postMessage({type:'frame',bmp,sx,sy,k,w:vw,h:vh},[bmp]);})
+    .catch(()=>{workerBusy=false;scheduleDetection();});
+}
+
+function adaptDetection(m){
+  faceBox=m.box;missCount=m.gaze?0:missCount+1;
+  // Benchmark frames swap backends and compile kernels; don't adapt to them
+  if(m.benching){queueText('detectInfo',`benchmarking ${m.backend}: ${m.ms.toFixed(1)} ms`);return;}
+  inferMs=inferMs?inferMs*0.8+m.ms*0.2:m.ms;
+  perf.detN++;perf.inferSum+=m.ms;perf.backend=m.backend;
+  const budget=1000/detectHz;
+  if(inferMs>budget*0.8){fastCount=0;if(++slowCount>=3&&detectScale<DETECT_SCALES.length-1){detectScale++;slowCount=0;}}
+  else if(inferMs<budget*0.35){slowCount=0;if(++fastCount>=10&&detectScale>0){detectScale--;fastCount=0;}}
+  else slowCount=fastCount=0;
+  // A miss on a crop may just mean the face left it; faceBox is then null and
+  // the next frame goes out uncropped
+  queueText('detectInfo',`${m.backend} ${inferMs.toFixed(1)} ms, x${DETECT_SCALES[detectScale]}${faceBox?' crop':''}${missCount>IDLE_AFTER_MISSES?' idle':''}`);
+}
+
+function applyGaze(m){
+  drawEyeTracking(m,$('eyeCanvas'));
+  const gaze=m.gaze;
+  const fire=updateGazePolicy(gaze,performance.now());
+  if(gaze){
+    queueText('leftEyePos',`(${Math.round(gaze.leftIris.x)}, ${Math.round(gaze.leftIris.y)})`);
+    queueText('rightEyePos',`(${Math.round(gaze.rightIris.x)}, ${Math.round(gaze.rightIris.y)})`);
+    queueText('gazeDir',`X:${gz.x.toFixed(2)} Y:${gz.y.toFixed(2)}`);
+    queueText('gazeConf',`${gaze.confidence}%`);
+    setIndicator(circleW/2-gz.x*60,circleH/2+gz.y*2,true,gz.looking);
+    if(gz.looking){setEyeStatus(gz.fired?'LOOKING AT CAMERA':'LOOKING...','looking');if(fire)triggerEyetrackCapture();}
+    else setEyeStatus('Looking away...','not-looking');
+  }else if(!m.pts){
+    setEyeStatus('No face detected','not-looking');
+    for(const id of['leftEyePos','rightEyePos','gazeDir','gazeConf'])queueText(id,'--');
+    setIndicator(0,0,false,false);
+  }
 }
 
-async function startEyeTracking(){if(!detector){$('eyeStatusText').textContent='Model not loaded yet';return;}const started=await startWebcam();if(!started)return;eyetrackActive=true;$('startEyetrack').disabled=true;$('stopEyetrack').disabled=false;$('eyeStatusText').textContent='Tracking active...';runDetection();}
-function stopEyeTracking(){eyetrackActive=false;if(detectLoop){cancelAnimationFrame(detectLoop);detectLoop=null;}stopWebcam();$('startEyetrack').disabled=false;$('stopEyetrack').disabled=true;$('eyeStatusText').textContent='Stopped';$('eyeStatusText').className='not-looking';$('gazeIndicator').classList.remove('active');const canvas=$('eyeCanvas');const ctx=canvas.getContext('2d');ctx.clearRect(0,0,canvas.width,canvas.height);}
+async function startEyeTracking(){if(!workerReady){$('eyeStatusText').textContent='Model not loaded yet';return;}const started=await startWebcam();if(!started)return;eyetrackActive=true;faceBox=null;missCount=0;lastDetectStart=0;gz.t=0;gz.looking=false;$('startEyetrack').disabled=true;$('stopEyetrack').disabled=false;$('eyeStatusText').textContent='Tracking active...';runDetection();}
+function stopEyeTracking(){eyetrackActive=false;workerBusy=false;if(detectLoop){clearTimeout(detectLoop);detectLoop=null;}queueText('detectInfo','--');stopWebcam();$('startEyetrack').disabled=false;$('stopEyetrack').disabled=true;setEyeStatus('Stopped','not-looking');setIndicator(0,0,false,false);const canvas=$('eyeCanvas');canvas.getContext('2d').clearRect(0,0,canvas.width,canvas.height);}
 
-$('dlBtn').onclick=()=>{if(curBlob){const a=document.createElement('a');a.href=URL.createObjectURL(curBlob);a.download='capture_'+Date.now()+'.jpg';a.click();}};
+$('dlBtn').onclick=()=>{if(curBlob)saveBlob(curBlob,'capture_'+Date.now()+'.jpg');};
 document.querySelectorAll('.tab').forEach(t=>{t.onclick=()=>{document.querySelectorAll('.tab').forEach(x=>x.classList.remove('active'));t.classList.add('active');tab=t.dataset.tab;updateGal();};});
 $('probSlider').oninput=function(){captureProb=this.value/100;$('probVal').textContent=this.value+'%';};
+$('detectHz').onchange=function(){detectHz=+this.value;slowCount=fastCount=0;};
 $('startEyetrack').onclick=startEyeTracking;$('stopEyetrack').onclick=stopEyeTracking;
 
-let es;
-function connectTerm(){$('termPill').textContent='Connecting...';es=new EventSource('/events');es.onopen=()=>$('termPill').textContent='Live';es.onerror=()=>$('termPill').textContent='Offline';es.onmessage=e=>{if(e.data){const d=document.createElement('div');d.textContent=e.data;if(e.data.includes('[stream]'))d.style.color='#8f8';if(e.data.includes('[rec]')||e.data.includes('[btn]'))d.style.color='#ff8';if(e.data.includes('[eye]'))d.style.color='#ff6b35';$('termBox').appendChild(d);while($('termBox').childNodes.length>500)$('termBox').removeChild($('termBox').firstChild);$('termBox').scrollTop=$('termBox').scrollHeight;}};}
-connectTerm();
+// Terminal: lines are queued and flushed once per animation frame into a
+// fixed-row virtual list; only the rows in view exist in the DOM. The colour
+// class comes from the line's leading [tag], parsed once on arrival.
+const TERM_MAX=500,TERM_ROW=16,TERM_TAG_CLASS={stream:'t-stream',rec:'t-rec',btn:'t-rec',eye:'t-eye'};
+let termLines=[],termPending=[],termRaf=0,termStick=true,termViewH=200;
+// rAF is paused in hidden tabs, so bound the backlog here rather than in termFlush
+function termLine(t){termPending.push(t);if(termPending.length>TERM_MAX)termPending.shift();if(!termRaf)termRaf=requestAnimationFrame(termFlush);}
+function termFlush(){
+  termRaf=0;
+  for(const t of termPending){const m=/^\[(\w+)\]/.exec(t);termLines.push({t,c:m&&TERM_TAG_CLASS[m[1]]||''});}
+  termPending=[];
+  if(termLines.length>TERM_MAX)termLines.splice(0,termLines.length-TERM_MAX);
+  termRender(true);
+}
+function termRender(flush){
+  const box=$('termBox'),rows=$('termRows'),h=termLines.length*TERM_ROW+'px';
+  if($('termSpacer').style.height!==h)$('termSpacer').style.height=h;
+  if(flush&&termStick)box.scrollTop=termLines.length*TERM_ROW;
+  const first=Math.max(0,Math.floor(box.scrollTop/TERM_ROW)),n=Math.ceil(termViewH/TERM_ROW)+1;
+  while(rows.childElementCount<n)rows.appendChild(document.createElement('div'));
+  rows.style.transform=`translateY(${first*TERM_ROW}px)`;
+  for(let i=0;i<rows.childElementCount;i++){
+    const d=rows.children[i],l=termLines[first+i],t=l?l.t:'',c=l?l.c:'';
+    if(d.textContent!==t)d.textContent=t;
+    if(d.className!==c)d.className=c;
+  }
+}
+function initTerm(){
+  const box=$('termBox');
+  box.addEventListener('scroll',()=>{termStick=box.scrollTop+termViewH>=termLines.length*TERM_ROW-TERM_ROW;if(!termRaf)termRaf=requestAnimationFrame(termFlush);},{passive:true});
+  new ResizeObserver(()=>{termViewH=box.clientHeight;termRender(false);}).observe(box);
+}
+
+let es=null;
+function connectTerm(){$('termPill').textContent='Connecting...';es=new EventSource('/events');es.onopen=()=>$('termPill').textContent='Live';es.onerror=()=>$('termPill').textContent='Offline';es.onmessage=e=>{if(e.data)termLine(e.data);};}
+
+function applyStatus(v){
+  const f=v.getUint8(1),used=v.getUint32(20,true),total=v.getUint32(24,true),rev=v.getUint32(28,true);
+  if(f&2){$('sdPill').textContent='OK';$('sdStatus').textContent=`${used}/${total}MB`;$('sdBar').style.width=(total?used/total*100:0)+'%';}else{$('sdPill').textContent='No Card';$('sdStatus').textContent='Not available';}
+  $('recPill').style.display=(f&4)?'inline-block':'none';
+  triggerCount=v.getUint32(12,true);captureCount=v.getUint32(16,true);$('triggerCount').textContent=triggerCount;$('captureCount').textContent=captureCount;
+  if(rev!==sdRev){sdRev=rev;loadSDList();}
+}
+
+function onTriggerResult(ok,total,text){
+  perfTrigger();
+  if(!ok){console.error('Eye track capture failed:',text);return;}
+  captureCount=total;$('captureCount').textContent=captureCount;console.log('Eye track photo saved:',text);
+  $('eyetrackCircle').style.borderColor='#0f0';setTimeout(()=>{$('eyetrackCircle').style.borderColor='#ff6b35';},200);
+}
+
+function connectWs(){
+  ws=new WebSocket(`ws://${location.host}/ws`);ws.binaryType='arraybuffer';
+  ws.onopen=()=>{wsReady=wsEverOpen=true;if(es){es.close();es=null;}$('termPill').textContent='Live';ws.send(Uint8Array.of(WS_STATUS));};
+  ws.onclose=()=>{wsReady=false;ws=null;$('termPill').textContent='Offline';if(!wsEverOpen&&!es){connectTerm();return;}setTimeout(connectWs,2000);};
+  ws.onmessage=e=>{
+    if(!(e.data instanceof ArrayBuffer)||e.data.byteLength<1)return;
+    const v=new DataView(e.data),op=v.getUint8(0),txt=o=>new TextDecoder().decode(new Uint8Array(e.data,o));
+    if(op===WS_LOG)termLine(txt(1));
+    else if(op===WS_STATUS&&v.byteLength>=32)applyStatus(v);
+    else if(op===WS_PING&&v.byteLength>=8){if(perf.pingAt&&v.getUint32(4,true)===perf.pingTok){perf.linkRtt=performance.now()-perf.pingAt;perf.pingAt=0;}}
+    else if(op===WS_TRIGGER&&v.byteLength>=8)onTriggerResult(v.getUint8(1)===1,v.getUint32(4,true),txt(8));
+    else if(op===WS_CAPTURED&&v.byteLength>=12&&(v.getUint8(1)&2))setStatus(`Saved ${txt(12)}`);
+  };
+}
+connectWs();
+
+// Performance HUD: per-second samples of display fps and frame jitter,
+// inference time and rate, trigger-to-save and link round trips, request
+// timings (PerformanceObserver resource entries) and main-thread long tasks.
+// Always collected cheaply; shown and exportable as CSV on demand.
+const PERF_ROWS=3600,PERF_COLS=['time','fps','jitter_ms','infer_ms','detect_hz','backend','trigger_rtt_ms','link_rtt_ms','capture_ms','sd_status_ms','long_tasks','long_task_ms'];
+const perf={last:0,iv:[],detN:0,inferSum:0,backend:'',trigAt:0,trigRtt:0,pingAt:0,pingTok:0,linkRtt:0,res:{},longN:0,longMs:0,rows:[]};
+let hudOn=false;
+function perfFrame(){const now=performance.now();if(perf.last)perf.iv.push(now-perf.last);perf.last=now;}
+function perfTrigger(){if(perf.trigAt){perf.trigRtt=performance.now()-perf.trigAt;perf.trigAt=0;}}
+function perfSample(){
+  const iv=perf.iv,n=iv.length;
+  let mean=0,sd=0;
+  if(n){for(const x of iv)mean+=x;mean/=n;for(const x of iv)sd+=(x-mean)*(x-mean);sd=Math.sqrt(sd/n);}
+  // A stalled stream shows 0 fps rather than the last rate
+  if(!n&&performance.now()-perf.last>1000)perf.last=0;
+  const row=[new Date().toISOString(),n?1000/mean:0,sd,perf.detN?perf.inferSum/perf.detN:0,perf.detN,perf.backend,perf.trigRtt,perf.linkRtt,perf.res['/capture']||0,perf.res['/sd/status']||0,perf.longN,perf.longMs];
+  perf.iv=[];perf.detN=0;perf.inferSum=0;perf.longN=0;perf.longMs=0;
+  perf.rows.push(row);if(perf.rows.length>PERF_ROWS)perf.rows.shift();
+  // Link RTT only counts the echo of this ping, not status frames the device pushes on its own
+  if(wsReady&&hudOn){const m=new DataView(new ArrayBuffer(8));perf.pingTok=(perf.pingTok+1)>>>0;m.setUint8(0,WS_PING);m.setUint32(4,perf.pingTok,true);perf.pingAt=performance.now();ws.send(m.buffer);}
+  if(hudOn){
+    const f=x=>(+x).toFixed(1);
+    $('hudText').textContent=`stream  ${f(row[1])} fps  jitter ${f(row[2])} ms\ndetect  ${f(row[3])} ms @ ${row[4]} Hz ${row[5]}\ntrigger ${f(row[6])} ms  link ${wsReady?f(row[7])+' ms':'(SSE) '+f(row[9])+' ms'}\ncapture ${f(row[8])} ms\nmain    ${row[10]} long tasks, ${f(row[11])} ms`;
+  }
+}
+function perfCsv(){
+  const csv=[PERF_COLS.join(',')].concat(perf.rows.map(r=>r.map(x=>typeof x==='number'?x.toFixed(2):x).join(','))).join('\n');
+  saveBlob(new Blob([csv],{type:'text/csv'}),'perf_'+Date.now()+'.csv');
+}
+function initPerf(){
+  try{new PerformanceObserver(l=>{for(const e of l.getEntries())perf.res[new URL(e.name).pathname]=e.duration;performance.clearResourceTimings();}).observe({type:'resource'});}catch(e){}
+  try{new PerformanceObserver(l=>{for(const e of l.getEntries()){perf.longN++;perf.longMs+=e.duration;}}).observe({type:'longtask'});}catch(e){}
+  setInterval(perfSample,1000);
+  const toggle=()=>{hudOn=!hudOn;$('hud').style.display=hudOn?'block':'none';};
+  $('hudBtn').onclick=toggle;$('hudCsv').onclick=perfCsv;
+}
 
-$('termClear').onclick=async()=>{$('termBox').innerHTML='';try{await fetch('/log/clear')}catch{}};
+$('termClear').onclick=async()=>{termLines=[];termPending=[];termStick=true;termRender(false);try{await fetch('/log/clear')}catch{}};
 $('photoBtn').onclick=()=>setMode('photo');$('videoBtn').onclick=()=>setMode('video');
-$('captureBtn').onclick=capture;$('startBtn').onclick=startStream;$('stopBtn').onclick=stopStream;
+$('captureBtn').onclick=capture;$('startBtn').onclick=startStream;$('wsStreamBtn').onclick=startWsStream;$('stopBtn').onclick=stopStream;
 $('flashOn').onclick=()=>flash(true);$('flashOff').onclick=()=>flash(false);
 $('clearBtn').onclick=clearGal;$('refreshBtn').onclick=loadSD;$('sdRefresh').onclick=loadSD;
 
-setMode('photo');updateGal();loadSD();setInterval(loadSD,5000);initEyeTracking();
+setMode('photo');initGal();initTerm();initPerf();initEyeOverlay();updateGal();loadSD();setInterval(()=>{if(!wsReady)loadSD();},5000);initEyeTracking();
 </script>
 </body>
 </html>
@@ -1316,12 +3897,151 @@ setMode('photo');updateGal();loadSD();setInterval(loadSD,5000);initEyeTracking()
   return httpd_resp_send(req, INDEX_HTML, HTTPD_RESP_USE_STRLEN);
 }
 
+// Face landmark inference for the index page. Runs in a dedicated worker so
+// model execution never blocks the page thread; the page transfers webcam
+// frames in as ImageBitmaps and gets gaze results plus overlay points back.
+static esp_err_t eye_worker_handler(httpd_req_t *req) {
+  static const char EYE_WORKER_JS[] PROGMEM = R"JS(
+importScripts('https://cdn.jsdelivr.net/npm/@tensorflow/tfjs@4.10.0/dist/tf.min.js');
+// Optional backends; whichever loads is benchmarked alongside WebGL
+try{importScripts('https://cdn.jsdelivr.net/npm/@tensorflow/tfjs-backend-wasm@4.10.0/dist/tf-backend-wasm.min.js');tf.wasm.setWasmPaths('https://cdn.jsdelivr.net/npm/@tensorflow/tfjs-backend-wasm@4.10.0/dist/');}catch(e){}
+try{if(self.navigator.gpu)importScripts('https://cdn.jsdelivr.net/npm/@tensorflow/tfjs-backend-webgpu@4.10.0/dist/tf-backend-webgpu.min.js');}catch(e){}
+importScripts('https://cdn.jsdelivr.net/npm/@tensorflow-models/face-landmarks-detection@1.0.5/dist/face-landmarks-detection.min.js');
+const BACKENDS=['webgpu','webgl','wasm'],BENCH_WARMUP=2,BENCH_FRAMES=3;
+// Landmark groups as index tables into the keypoint array. PT_ORDER is the
+// overlay layout the page expects: left eye, right eye, left iris, right iris.
+const LEFT_IRIS=Uint16Array.of(468,469,470,471,472),RIGHT_IRIS=Uint16Array.of(473,474,475,476,477);
+const LEFT_EYE=Uint16Array.of(33,7,163,144,145,153,154,155,133,173,157,158,159,160,161,246);
+const RIGHT_EYE=Uint16Array.of(362,382,381,380,374,373,390,249,263,466,388,387,386,385,384,398);
+const PT_ORDER=Uint16Array.from([...LEFT_EYE,...RIGHT_EYE,...LEFT_IRIS,...RIGHT_IRIS]);
+const MIN_KEYPOINTS=478;
+// Per-group scratch: center x, center y, min x, max x
+const G_LE=0,G_RE=4,G_LI=8,G_RI=12,stats=new Float64Array(16);
+let detector=null,bench=null;
+
+// Single pass over one group's indices, no temporaries
+function reduceGroup(kp,idx,o){
+  let sx=0,sy=0,mn=Infinity,mx=-Infinity;
+  for(let i=0;i<idx.length;i++){const p=kp[idx[i]];sx+=p.x;sy+=p.y;if(p.x<mn)mn=p.x;if(p.x>mx)mx=p.x;}
+  stats[o]=sx/idx.length;stats[o+1]=sy/idx.length;stats[o+2]=mn;stats[o+3]=mx;
+}
+
+// Keypoints are in the (cropped, scaled) bitmap; f maps them back to video
+// pixels so the pixel thresholds below don't depend on the detector input.
+function calculateGazeDirection(face,f){
+  const kp=face.keypoints;
+  if(kp.length<MIN_KEYPOINTS)return null;
+  reduceGroup(kp,LEFT_EYE,G_LE);reduceGroup(kp,RIGHT_EYE,G_RE);
+  reduceGroup(kp,LEFT_IRIS,G_LI);reduceGroup(kp,RIGHT_IRIS,G_RI);
+  for(let o=0;o<16;o+=4){stats[o]=f.sx+stats[o]/f.k;stats[o+1]=f.sy+stats[o+1]/f.k;stats[o+2]=f.sx+stats[o+2]/f.k;stats[o+3]=f.sx+stats[o+3]/f.k;}
+  const leftEyeWidth=stats[G_LE+3]-stats[G_LE+2];
+  const rightEyeWidth=stats[G_RE+3]-stats[G_RE+2];
+  const leftGazeX=(stats[G_LI]-stats[G_LE])/(leftEyeWidth/2);
+  const rightGazeX=(stats[G_RI]-stats[G_RE])/(rightEyeWidth/2);
+  const avgGazeX=(leftGazeX+rightGazeX)/2;
+  const avgGazeY=((stats[G_LI+1]-stats[G_LE+1])+(stats[G_RI+1]-stats[G_RE+1]))/2;
+  const gazeThreshold=0.3;
+  const isLooking=Math.abs(avgGazeX)<gazeThreshold&&Math.abs(avgGazeY)<20;
+  const confidence=face.box?Math.min(100,Math.round((1-Math.abs(avgGazeX))*100)):0;
+  return{leftIris:{x:stats[G_LI],y:stats[G_LI+1]},rightIris:{x:stats[G_RI],y:stats[G_RI+1]},leftEye:{x:stats[G_LE],y:stats[G_LE+1]},rightEye:{x:stats[G_RE],y:stats[G_RE+1]},gazeX:avgGazeX,gazeY:avgGazeY,isLooking,confidence};
+}
+
+// The buffer is transferred to the page, so each frame needs a fresh one
+function overlayPoints(kp,f){
+  if(kp.length<MIN_KEYPOINTS)return null;
+  const pts=new Float32Array(PT_ORDER.length*2);
+  for(let i=0;i<PT_ORDER.length;i++){const p=kp[PT_ORDER[i]];pts[i*2]=f.sx+p.x/f.k;pts[i*2+1]=f.sy+p.y/f.k;}
+  return pts;
+}
+
+function availableBackends(){return BACKENDS.filter(b=>tf.findBackendFactory(b)&&(b!=='webgpu'||self.navigator.gpu));}
+
+// Switches backend and rebuilds the detector on it. One inference on a blank
+// frame compiles the detector's kernels so they don't land on real frames.
+async function useBackend(name){
+  if(detector){detector.dispose();detector=null;}
+  try{if(!(await tf.setBackend(name)))return false;await tf.ready();}catch(e){return false;}
+  const model=faceLandmarksDetection.SupportedModels.MediaPipeFaceMesh;
+  detector=await faceLandmarksDetection.createDetector(model,{runtime:'tfjs',refineLandmarks:true,maxFaces:1});
+  const blank=tf.zeros([240,320,3],'int32');
+  try{await detector.estimateFaces(blank);}finally{blank.dispose();}
+  return true;
+}
+
+// Without a remembered choice, the first real frames are spread over every
+// available backend: BENCH_WARMUP untimed, then BENCH_FRAMES timed, each.
+async function init(m){
+  try{
+    await tf.ready();
+    const list=availableBackends();
+    if(m.backend&&list.includes(m.backend)&&await useBackend(m.backend)){
+      postMessage({type:'ready',backend:m.backend,cached:true});
+      return;
+    }
+    bench={list,i:-1,n:0,sum:0,times:{}};
+    if(!await benchNext())throw new Error('no usable TF.js backend');
+    postMessage({type:'ready',backend:tf.getBackend(),cached:false});
+  }catch(e){postMessage({type:'error',msg:e.message});}
+}
+
+async function benchNext(){
+  while(++bench.i<bench.list.length){
+    bench.n=0;bench.sum=0;
+    try{if(await useBackend(bench.list[bench.i]))return true;}catch(e){}
+  }
+  return false;
+}
+
+async function benchStep(ms){
+  if(++bench.n>BENCH_WARMUP)bench.sum+=ms;
+  if(bench.n<BENCH_WARMUP+BENCH_FRAMES)return;
+  bench.times[bench.list[bench.i]]=bench.sum/BENCH_FRAMES;
+  if(await benchNext())return;
+  const times=bench.times;bench=null;
+  const best=Object.keys(times).reduce((a,b)=>times[b]<times[a]?b:a);
+  if(tf.getBackend()!==best)await useBackend(best);
+  postMessage({type:'backend',backend:best,times});
+}
+
+// f: {bmp, sx, sy, k, w, h} - bitmap cropped at (sx,sy) of a w x h video and scaled by k
+async function detect(f){
+  const w=f.w,h=f.h;
+  try{
+    const t0=performance.now();
+    const faces=await detector.estimateFaces(f.bmp);
+    const ms=performance.now()-t0;
+    const benching=!!bench,backend=tf.getBackend();
+    // Finish any backend switch before the page sends the next frame
+    if(bench)await benchStep(ms);
+    if(faces.length>0){
+      const face=faces[0],b=face.box,pts=overlayPoints(face.keypoints,f);
+      const box=b?{x:f.sx+b.xMin/f.k,y:f.sy+b.yMin/f.k,w:b.width/f.k,h:b.height/f.k}:null;
+      postMessage({type:'result',w,h,ms,backend,benching,box,gaze:calculateGazeDirection(face,f),pts},pts?[pts.buffer]:[]);
+    }
+    else postMessage({type:'result',w,h,ms,backend,benching,box:null,gaze:null,pts:null});
+  }catch(e){postMessage({type:'error',msg:e.message});}
+  finally{f.bmp.close();}
+}
+
+onmessage=e=>{
+  const m=e.data;
+  if(m.type==='init')init(m);
+  else if(m.type==='frame'){if(detector)detect(m);else{m.bmp.close();postMessage({type:'error',msg:'model not loaded'});}}
+};
+)JS";
+
+  httpd_resp_set_type(req, "application/javascript");
+  httpd_resp_set_hdr(req, "Cache-Control", "max-age=3600");
+  return httpd_resp_send(req, EYE_WORKER_JS, HTTPD_RESP_USE_STRLEN);
+}
+
 // ============================ WEBSERVER ============================
 static void start_webserver() {
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
   config.server_port = 80;
-  config.max_uri_handlers = 14;
-  config.stack_size = 8192;
+  config.max_uri_handlers = 24;
+  config.stack_size = CFG(CFG_HTTPD_STACK);
+  config.close_fn = ws_on_close;
 
   if (httpd_start(&g_httpd, &config) != ESP_OK) {
     log_pushf("[http] start failed");
@@ -1330,6 +4050,7 @@ static void start_webserver() {
 
   httpd_uri_t uris[] = {
     {"/",               HTTP_GET, index_handler,           NULL},
+    {"/eyeworker.js",   HTTP_GET, eye_worker_handler,      NULL},
     {"/capture",        HTTP_GET, capture_handler,         NULL},
     {"/stream",         HTTP_GET, stream_handler,          NULL},
     {"/flash",          HTTP_GET, flash_handler,           NULL},
@@ -1338,14 +4059,616 @@ static void start_webserver() {
     {"/sd/status",      HTTP_GET, sd_status_handler,       NULL},
     {"/sd/list",        HTTP_GET, sd_list_handler,         NULL},
     {"/sd/download",    HTTP_GET, sd_download_handler,     NULL},
+    {"/sd/play",        HTTP_GET, sd_play_handler,         NULL},
     {"/sd/delete",      HTTP_GET, sd_delete_handler,       NULL},
     {"/eyetrack/capture", HTTP_GET, eyetrack_capture_handler, NULL},
     {"/eyetrack/stats",   HTTP_GET, eyetrack_stats_handler,   NULL},
+    {"/ws",             HTTP_GET, ws_handler,              NULL, true},
+    {"/ws/stream",      HTTP_GET, ws_stream_handler,       NULL, true},
+    {"/udp/push",       HTTP_GET, udp_push_handler,        NULL},
+    {"/config",         HTTP_GET, config_handler,          NULL},
+    {"/camera/stats",   HTTP_GET, camera_stats_handler,    NULL},
   };
 
   for (auto& u : uris) httpd_register_uri_handler(g_httpd, &u);
   
-  log_pushf("[http] server ready (12 endpoints)");
+  start_ws_push();
+  
+  log_pushf("[http] server ready (%u endpoints)", (unsigned)(sizeof(uris) / sizeof(uris[0])));
+}
+
+// ============================ RTSP / RTP-JPEG ============================
+
+static uint16_t be16(const uint8_t* p) { return (p[0] << 8) | p[1]; }
+
+static bool jpeg_parse(const uint8_t* buf, size_t len, JpegInfo* j) {
+  memset(j, 0, sizeof(*j));
+  if (len < 4 || buf[0] != 0xFF || buf[1] != 0xD8) return false;
+  
+  size_t i = 2;
+  while (i + 4 <= len) {
+    if (buf[i] != 0xFF) return false;
+    uint8_t marker = buf[i + 1];
+    if (marker == 0xFF) { i++; continue; }
+    
+    size_t seg = be16(buf + i + 2);
+    const uint8_t* p = buf + i + 4;
+    if (seg < 2 || i + 2 + seg > len) return false;
+    
+    switch (marker) {
+      case 0xDB:  // DQT, may hold several tables
+        for (size_t k = 0; k + 65 <= seg - 2; k += 65) {
+          uint8_t precision = p[k] >> 4;
+          uint8_t id = p[k] & 0x0F;
+          if (precision != 0 || id > 1) return false;
+          j->qt[id] = p + k + 1;
+        }
+        break;
+      case 0xC0:  // SOF0: precision, height, width, components
+        if (seg < 11) return false;
+        j->height = be16(p + 1);
+        j->width = be16(p + 3);
+        if (p[7] == 0x21) j->type = 0;
+        else if (p[7] == 0x22) j->type = 1;
+        else return false;
+        break;
+      case 0xDD:  // DRI
+        j->dri = be16(p);
+        break;
+      case 0xDA: {  // SOS: entropy-coded data runs to EOI
+        size_t start = i + 2 + seg;
+        size_t end = len;
+        while (end > start + 2 && !(buf[end - 2] == 0xFF && buf[end - 1] == 0xD9)) end--;
+        if (end <= start + 2) return false;
+        j->scan = buf + start;
+        j->scan_len = end - 2 - start;
+        return j->qt[0] && j->qt[1] && j->width && j->height &&
+               j->width <= 2040 && j->height <= 2040;
+      }
+    }
+    i += 2 + seg;
+  }
+  return false;
+}
+
+static void rtsp_close(RtspSession* s, const char* why) {
+  log_pushf("[rtsp] session %08X closed (%s)", s->id, why);
+  close(s->fd);
+  s->fd = -1;
+  s->setup = false;
+  s->playing = false;
+}
+
+static bool rtsp_send_rtp(RtspSession* s, uint8_t* pkt, size_t rtp_len) {
+  if (s->tcp) {
+    pkt[0] = '$';
+    pkt[1] = s->channel;
+    pkt[2] = rtp_len >> 8;
+    pkt[3] = rtp_len & 0xFF;
+    return send(s->fd, pkt, rtp_len + 4, 0) == (int)(rtp_len + 4);
+  }
+  
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (sendto(g_rtp_udp_fd, pkt + 4, rtp_len, 0,
+               (const sockaddr*)&s->rtp_addr, sizeof(s->rtp_addr)) == (int)rtp_len) {
+      return true;
+    }
+    if (errno != ENOMEM) break;
+    vTaskDelay(1);  // WiFi TX queue full, give it one tick
+  }
+  return false;
+}
+
+// Packetizes one frame per RFC 2435 and sends each packet to every playing
+// session. Packets are built once; only the interleave prefix differs.
+static void rtsp_send_frame(const JpegInfo& j, uint32_t rtp_ts) {
+  static uint8_t pkt[4 + 12 + 8 + 4 + 4 + 128 + RTP_MAX_PAYLOAD];
+  
+  for (auto& s : g_rtsp) s.frame_dropped = false;
+  
+  size_t offset = 0;
+  while (offset < j.scan_len) {
+    uint8_t* rtp = pkt + 4;
+    uint8_t* h = rtp + 12;
+    size_t hlen = 8;
+    
+    h[0] = 0;
+    h[1] = offset >> 16;
+    h[2] = offset >> 8;
+    h[3] = offset;
+    h[4] = j.type | (j.dri ? 64 : 0);
+    h[5] = 255;  // Q >= 128: tables travel in-band on the first packet
+    h[6] = j.width / 8;
+    h[7] = j.height / 8;
+    
+    if (j.dri) {
+      h[8] = j.dri >> 8;
+      h[9] = j.dri & 0xFF;
+      h[10] = 0xFF;
+      h[11] = 0xFF;
+      hlen += 4;
+    }
+    
+    if (offset == 0) {
+      h[hlen] = 0;
+      h[hlen + 1] = 0;
+      h[hlen + 2] = 0;
+      h[hlen + 3] = 128;
+      memcpy(h + hlen + 4, j.qt[0], 64);
+      memcpy(h + hlen + 68, j.qt[1], 64);
+      hlen += 132;
+    }
+    
+    size_t chunk = RTP_MAX_PAYLOAD - hlen;
+    if (chunk > j.scan_len - offset) chunk = j.scan_len - offset;
+    memcpy(h + hlen, j.scan + offset, chunk);
+    offset += chunk;
+    
+    bool last = offset >= j.scan_len;
+    uint16_t seq = g_rtp_seq++;
+    rtp[0] = 0x80;
+    rtp[1] = 26 | (last ? 0x80 : 0);
+    rtp[2] = seq >> 8;
+    rtp[3] = seq & 0xFF;
+    rtp[4] = rtp_ts >> 24;
+    rtp[5] = rtp_ts >> 16;
+    rtp[6] = rtp_ts >> 8;
+    rtp[7] = rtp_ts;
+    rtp[8] = g_rtp_ssrc >> 24;
+    rtp[9] = g_rtp_ssrc >> 16;
+    rtp[10] = g_rtp_ssrc >> 8;
+    rtp[11] = g_rtp_ssrc;
+    size_t rtp_len = 12 + hlen + chunk;
+    
+    for (auto& s : g_rtsp) {
+      if (s.fd < 0 || !s.playing || s.frame_dropped) continue;
+      if (rtsp_send_rtp(&s, pkt, rtp_len)) {
+        s.pkts++;
+        s.bytes += rtp_len;
+        if (last) s.frames++;
+      } else if (s.tcp) {
+        rtsp_close(&s, "send failed");
+      } else {
+        s.frame_dropped = true;
+        s.drops++;
+      }
+    }
+  }
+}
+
+static bool rtsp_header(const char* req, const char* name, char* out, size_t out_len) {
+  size_t nlen = strlen(name);
+  const char* line = strstr(req, "\r\n");
+  while (line && line[2] != '\r') {
+    line += 2;
+    if (strncasecmp(line, name, nlen) == 0 && line[nlen] == ':') {
+      const char* v = line + nlen + 1;
+      while (*v == ' ') v++;
+      size_t n = 0;
+      while (v[n] && v[n] != '\r' && n < out_len - 1) { out[n] = v[n]; n++; }
+      out[n] = '\0';
+      return true;
+    }
+    line = strstr(line, "\r\n");
+  }
+  return false;
+}
+
+static void rtsp_reply(RtspSession* s, const char* cseq, const char* status,
+                       const char* headers, const char* body) {
+  char buf[1024];
+  int n = snprintf(buf, sizeof(buf), "RTSP/1.0 %s\r\nCSeq: %s\r\n%s", status, cseq, headers ? headers : "");
+  if (body) {
+    n += snprintf(buf + n, sizeof(buf) - n, "Content-Length: %u\r\n\r\n%s", (unsigned)strlen(body), body);
+  } else {
+    n += snprintf(buf + n, sizeof(buf) - n, "\r\n");
+  }
+  if (n > (int)sizeof(buf)) n = sizeof(buf);
+  send(s->fd, buf, n, 0);
+}
+
+static void rtsp_handle_request(RtspSession* s, char* req) {
+  char method[16] = {0};
+  char url[128] = {0};
+  char cseq[16] = "0";
+  char hdrs[256];
+  sscanf(req, "%15s %127s", method, url);
+  rtsp_header(req, "CSeq", cseq, sizeof(cseq));
+  
+  if (strcmp(method, "OPTIONS") == 0) {
+    rtsp_reply(s, cseq, "200 OK", "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, GET_PARAMETER\r\n", NULL);
+  } else if (strcmp(method, "DESCRIBE") == 0) {
+    String ip = WiFi.localIP().toString();
+    char sdp[256];
+    snprintf(sdp, sizeof(sdp),
+             "v=0\r\no=- %u 1 IN IP4 %s\r\ns=%s\r\nc=IN IP4 0.0.0.0\r\nt=0 0\r\n"
+             "m=video 0 RTP/AVP 26\r\na=framerate:%d\r\na=control:track1\r\n",
+             g_rtp_ssrc, ip.c_str(), DEVICE_NAME, TARGET_STREAM_FPS);
+    snprintf(hdrs, sizeof(hdrs), "Content-Base: %s/\r\nContent-Type: application/sdp\r\n", url);
+    rtsp_reply(s, cseq, "200 OK", hdrs, sdp);
+  } else if (strcmp(method, "SETUP") == 0) {
+    char transport[128] = {0};
+    rtsp_header(req, "Transport", transport, sizeof(transport));
+    
+    const char* inter = strstr(transport, "interleaved=");
+    const char* cport = strstr(transport, "client_port=");
+    if (strstr(transport, "RTP/AVP/TCP") && inter) {
+      s->tcp = true;
+      s->channel = atoi(inter + 12);
+      snprintf(hdrs, sizeof(hdrs), "Transport: RTP/AVP/TCP;unicast;interleaved=%u-%u\r\n"
+               "Session: %08X;timeout=%u\r\n",
+               s->channel, s->channel + 1, s->id, RTSP_SESSION_TIMEOUT_MS / 1000);
+    } else if (cport) {
+      int rtp_port = atoi(cport + 12);
+      socklen_t alen = sizeof(s->rtp_addr);
+      getpeername(s->fd, (sockaddr*)&s->rtp_addr, &alen);
+      s->rtp_addr.sin_port = htons(rtp_port);
+      s->tcp = false;
+      snprintf(hdrs, sizeof(hdrs), "Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%u-%u\r\n"
+               "Session: %08X;timeout=%u\r\n",
+               rtp_port, rtp_port + 1, RTP_SERVER_PORT, RTP_SERVER_PORT + 1,
+               s->id, RTSP_SESSION_TIMEOUT_MS / 1000);
+    } else {
+      rtsp_reply(s, cseq, "461 Unsupported Transport", NULL, NULL);
+      return;
+    }
+    s->setup = true;
+    rtsp_reply(s, cseq, "200 OK", hdrs, NULL);
+  } else if (strcmp(method, "PLAY") == 0) {
+    if (!s->setup) {
+      rtsp_reply(s, cseq, "455 Method Not Valid in This State", NULL, NULL);
+      return;
+    }
+    if (g_stream_view.active && !s->playing) {
+      log_pushf("[rtsp] session %08X refused: sensor held by a stream view", s->id);
+      rtsp_reply(s, cseq, "453 Not Enough Bandwidth", NULL, NULL);
+      return;
+    }
+    snprintf(hdrs, sizeof(hdrs), "Session: %08X\r\nRange: npt=0.000-\r\nRTP-Info: url=%s;seq=%u\r\n",
+             s->id, url, g_rtp_seq);
+    rtsp_reply(s, cseq, "200 OK", hdrs, NULL);
+    if (!s->playing) {
+      s->playing = true;
+      s->pkts = s->bytes = s->frames = s->drops = 0;
+      s->stats_ms = millis();
+      set_stream_mode();
+      log_pushf("[rtsp] session %08X playing over %s", s->id, s->tcp ? "TCP" : "UDP");
+    }
+  } else if (strcmp(method, "TEARDOWN") == 0) {
+    snprintf(hdrs, sizeof(hdrs), "Session: %08X\r\n", s->id);
+    rtsp_reply(s, cseq, "200 OK", hdrs, NULL);
+    rtsp_close(s, "teardown");
+  } else if (strcmp(method, "GET_PARAMETER") == 0 || strcmp(method, "SET_PARAMETER") == 0) {
+    snprintf(hdrs, sizeof(hdrs), "Session: %08X\r\n", s->id);
+    rtsp_reply(s, cseq, "200 OK", hdrs, NULL);
+  } else {
+    rtsp_reply(s, cseq, "501 Not Implemented", NULL, NULL);
+  }
+}
+
+// Reads from the control socket and handles every complete request in the
+// buffer. Interleaved packets from the client (RTCP receiver reports) are skipped.
+static void rtsp_read(RtspSession* s) {
+  int n = recv(s->fd, s->rx + s->rx_len, RTSP_RX_BUF - 1 - s->rx_len, 0);
+  if (n <= 0) {
+    rtsp_close(s, "disconnected");
+    return;
+  }
+  s->rx_len += n;
+  s->rx[s->rx_len] = '\0';
+  s->last_rx_ms = millis();
+  
+  while (s->fd >= 0 && s->rx_len > 0) {
+    size_t used;
+    if (s->rx[0] == '$') {
+      if (s->rx_len < 4) break;
+      used = 4 + be16((uint8_t*)s->rx + 2);
+      if (used > s->rx_len) {
+        if (used >= RTSP_RX_BUF) rtsp_close(s, "oversized interleaved packet");
+        break;
+      }
+    } else {
+      char* end = strstr(s->rx, "\r\n\r\n");
+      if (!end) {
+        if (s->rx_len >= RTSP_RX_BUF - 1) rtsp_close(s, "request too large");
+        break;
+      }
+      used = end + 4 - s->rx;
+      end[2] = '\0';
+      rtsp_handle_request(s, s->rx);
+      if (s->fd < 0) break;
+    }
+    memmove(s->rx, s->rx + used, s->rx_len - used);
+    s->rx_len -= used;
+    s->rx[s->rx_len] = '\0';
+  }
+}
+
+static void rtsp_accept() {
+  sockaddr_in addr;
+  socklen_t alen = sizeof(addr);
+  int fd = accept(g_rtsp_listen_fd, (sockaddr*)&addr, &alen);
+  if (fd < 0) return;
+  
+  RtspSession* s = nullptr;
+  for (auto& slot : g_rtsp) {
+    if (slot.fd < 0) { s = &slot; break; }
+  }
+  if (!s) {
+    log_pushf("[rtsp] session limit reached");
+    close(fd);
+    return;
+  }
+  
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  timeval tv = {1, 0};
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  
+  memset(s, 0, sizeof(*s));
+  s->fd = fd;
+  s->id = esp_random();
+  s->last_rx_ms = millis();
+  log_pushf("[rtsp] session %08X from %s", s->id, inet_ntoa(addr.sin_addr));
+}
+
+static void rtsp_log_stats(uint32_t now) {
+  for (auto& s : g_rtsp) {
+    if (s.fd < 0 || !s.playing || now - s.stats_ms < RTSP_STATS_MS) continue;
+    float secs = (now - s.stats_ms) / 1000.0f;
+    log_pushf("[rtsp] %08X %s %.0f pkt/s %.1f fps %.0f kbit/s drop=%u",
+              s.id, s.tcp ? "tcp" : "udp", s.pkts / secs, s.frames / secs,
+              s.bytes * 8 / 1000.0f / secs, s.drops);
+    s.pkts = s.bytes = s.frames = s.drops = 0;
+    s.stats_ms = now;
+  }
+}
+
+// Single task for all sessions: select() on the control sockets, and grab and
+// send one frame every MIN_FRAME_TIME_MS while anyone is playing.
+static void rtsp_task(void*) {
+  uint32_t next_frame_ms = millis();
+  bool warned_parse = false;
+  
+  for (;;) {
+    bool playing = false;
+    fd_set rd;
+    FD_ZERO(&rd);
+    FD_SET(g_rtsp_listen_fd, &rd);
+    int maxfd = g_rtsp_listen_fd;
+    for (auto& s : g_rtsp) {
+      if (s.fd < 0) continue;
+      FD_SET(s.fd, &rd);
+      if (s.fd > maxfd) maxfd = s.fd;
+      playing |= s.playing;
+    }
+    
+    int32_t wait_ms = playing ? (int32_t)(next_frame_ms - millis()) : 1000;
+    if (wait_ms < 0) wait_ms = 0;
+    timeval tv = {wait_ms / 1000, (wait_ms % 1000) * 1000};
+    
+    if (select(maxfd + 1, &rd, NULL, NULL, &tv) > 0) {
+      if (FD_ISSET(g_rtsp_listen_fd, &rd)) rtsp_accept();
+      for (auto& s : g_rtsp) {
+        if (s.fd >= 0 && FD_ISSET(s.fd, &rd)) rtsp_read(&s);
+      }
+    }
+    
+    uint32_t now = millis();
+    for (auto& s : g_rtsp) {
+      // UDP clients only prove liveness through RTSP keepalives
+      if (s.fd >= 0 && !s.tcp && now - s.last_rx_ms > RTSP_SESSION_TIMEOUT_MS) rtsp_close(&s, "timeout");
+    }
+    
+    if (!playing || (int32_t)(now - next_frame_ms) < 0) continue;
+    next_frame_ms = now + MIN_FRAME_TIME_MS;
+    
+    camera_fb_t* fb = cam_fb_get();
+    if (!fb) continue;
+    aq_observe(AQ_STREAM, fb->len);
+    
+    JpegInfo j;
+    if (jpeg_parse(fb->buf, fb->len, &j)) {
+      uint64_t us = (uint64_t)fb->timestamp.tv_sec * 1000000ULL + fb->timestamp.tv_usec;
+      rtsp_send_frame(j, (uint32_t)(us * 9 / 100));
+    } else if (!warned_parse) {
+      log_pushf("[rtsp] unsupported JPEG layout (%u bytes)", fb->len);
+      warned_parse = true;
+    }
+    cam_fb_return(fb);
+    
+    rtsp_log_stats(millis());
+  }
+}
+
+static void start_rtsp_server() {
+  for (auto& s : g_rtsp) s.fd = -1;
+  g_rtp_ssrc = esp_random();
+  
+  g_rtsp_listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  g_rtp_udp_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (g_rtsp_listen_fd < 0 || g_rtp_udp_fd < 0) {
+    log_pushf("[rtsp] socket failed");
+    return;
+  }
+  
+  int one = 1;
+  setsockopt(g_rtsp_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(RTSP_PORT);
+  if (bind(g_rtsp_listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(g_rtsp_listen_fd, 2) != 0) {
+    log_pushf("[rtsp] listen on %u failed", RTSP_PORT);
+    return;
+  }
+  
+  addr.sin_port = htons(RTP_SERVER_PORT);
+  bind(g_rtp_udp_fd, (sockaddr*)&addr, sizeof(addr));
+  
+  xTaskCreate(rtsp_task, "rtsp", 6144, NULL, 3, NULL);
+  log_pushf("[rtsp] rtsp://%s:%u/mjpeg/1", WiFi.localIP().toString().c_str(), RTSP_PORT);
+}
+
+// ============================ UDP PUSH ============================
+
+static bool udp_push_send(const uint8_t* pkt, size_t len, const sockaddr_in& dst) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (sendto(g_udp_push_fd, pkt, len, 0, (const sockaddr*)&dst, sizeof(dst)) == (int)len) return true;
+    if (errno != ENOMEM) break;
+    vTaskDelay(1);  // WiFi TX queue full, give it one tick
+  }
+  return false;
+}
+
+// A frame whose fragment fails to send is abandoned rather than retried:
+// the receiver prefers the next fresh frame over a late one.
+static void udp_push_task(void*) {
+  static uint8_t pkt[sizeof(UdpFragHeader) + UDP_PUSH_PAYLOAD];
+  UdpFragHeader* hdr = (UdpFragHeader*)pkt;
+  uint32_t seq = 0;
+  uint32_t last_fps_time = millis();
+  uint32_t fps_frame_count = 0;
+  uint32_t fps_bytes = 0;
+  bool active = false;
+  
+  for (;;) {
+    if (!g_udp_push_enabled) {
+      if (active) {
+        log_pushf("[udp] push stopped after %u frames (%u dropped)", g_udp_push_frames, g_udp_push_dropped);
+        active = false;
+      }
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      continue;
+    }
+    
+    if (!active) {
+      active = true;
+      g_udp_push_frames = g_udp_push_dropped = 0;
+      fps_frame_count = fps_bytes = 0;
+      last_fps_time = millis();
+      set_stream_mode();
+    }
+    
+    uint32_t frame_start = millis();
+    camera_fb_t* fb = cam_fb_get();
+    if (!fb) {
+      delay(10);
+      continue;
+    }
+    aq_observe(AQ_STREAM, fb->len);
+    
+    portENTER_CRITICAL(&g_udp_push_mux);
+    sockaddr_in dst = g_udp_push_addr;
+    portEXIT_CRITICAL(&g_udp_push_mux);
+    
+    uint16_t frag_count = (fb->len + UDP_PUSH_PAYLOAD - 1) / UDP_PUSH_PAYLOAD;
+    hdr->magic = htons(UDP_FRAG_MAGIC);
+    hdr->version = UDP_FRAG_VERSION;
+    hdr->flags = 0;
+    hdr->frame_seq = htonl(seq++);
+    hdr->frame_len = htonl(fb->len);
+    hdr->capture_us = htonl((uint32_t)(fb->timestamp.tv_sec * 1000000ULL + fb->timestamp.tv_usec));
+    hdr->send_us = htonl((uint32_t)esp_timer_get_time());
+    hdr->frag_count = htons(frag_count);
+    
+    bool ok = true;
+    for (uint16_t i = 0; i < frag_count && ok; i++) {
+      size_t offset = (size_t)i * UDP_PUSH_PAYLOAD;
+      size_t chunk = fb->len - offset;
+      if (chunk > UDP_PUSH_PAYLOAD) chunk = UDP_PUSH_PAYLOAD;
+      hdr->frag_offset = htonl(offset);
+      hdr->frag_index = htons(i);
+      memcpy(pkt + sizeof(UdpFragHeader), fb->buf + offset, chunk);
+      ok = udp_push_send(pkt, sizeof(UdpFragHeader) + chunk, dst);
+    }
+    
+    if (ok) {
+      g_udp_push_frames++;
+      fps_frame_count++;
+      fps_bytes += fb->len;
+    } else {
+      g_udp_push_dropped++;
+    }
+    cam_fb_return(fb);
+    
+    uint32_t now = millis();
+    if (now - last_fps_time >= 5000) {
+      float secs = (now - last_fps_time) / 1000.0f;
+      log_pushf("[udp] %.1f fps %.0f kbit/s dropped=%u",
+                fps_frame_count / secs, fps_bytes * 8 / 1000.0f / secs, g_udp_push_dropped);
+      fps_frame_count = fps_bytes = 0;
+      last_fps_time = now;
+    }
+    
+    uint32_t frame_time = millis() - frame_start;
+    if (frame_time < MIN_FRAME_TIME_MS) {
+      delay(MIN_FRAME_TIME_MS - frame_time);
+    }
+  }
+}
+
+// Empty or unparsable host disables the push.
+static bool udp_push_set_target(const char* host, uint16_t port) {
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  bool valid = has_text(host) && port != 0 && inet_aton(host, &addr.sin_addr);
+  if (valid && g_stream_view.active) {
+    log_pushf("[udp] push refused: sensor held by a stream view");
+    return false;
+  }
+  
+  portENTER_CRITICAL(&g_udp_push_mux);
+  if (valid) g_udp_push_addr = addr;
+  g_udp_push_enabled = valid && g_udp_push_fd >= 0;
+  portEXIT_CRITICAL(&g_udp_push_mux);
+  
+  if (g_udp_push_enabled) {
+    log_pushf("[udp] push to %s:%u", host, port);
+    xTaskNotifyGive(g_udp_push_task);
+  }
+  return valid;
+}
+
+static esp_err_t udp_push_handler(httpd_req_t *req) {
+  char query[96] = {0};
+  char host[32] = {0};
+  char port[8] = {0};
+  
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+      httpd_query_key_value(query, "host", host, sizeof(host)) == ESP_OK) {
+    uint16_t p = UDP_PUSH_PORT;
+    if (httpd_query_key_value(query, "port", port, sizeof(port)) == ESP_OK) p = atoi(port);
+    udp_push_set_target(host, p);
+  }
+  
+  portENTER_CRITICAL(&g_udp_push_mux);
+  sockaddr_in dst = g_udp_push_addr;
+  bool enabled = g_udp_push_enabled;
+  portEXIT_CRITICAL(&g_udp_push_mux);
+  
+  char response[160];
+  snprintf(response, sizeof(response),
+           "{\"enabled\":%s,\"host\":\"%s\",\"port\":%u,\"frames\":%u,\"dropped\":%u}",
+           enabled ? "true" : "false", inet_ntoa(dst.sin_addr), ntohs(dst.sin_port),
+           g_udp_push_frames, g_udp_push_dropped);
+  
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
+}
+
+static void start_udp_push() {
+  g_udp_push_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (g_udp_push_fd < 0) {
+    log_pushf("[udp] socket failed");
+    return;
+  }
+  xTaskCreate(udp_push_task, "udp_push", 4096, NULL, 3, &g_udp_push_task);
+  udp_push_set_target(UDP_PUSH_HOST, UDP_PUSH_PORT);
 }
 
 // ============================ SETUP ============================
@@ -1353,22 +4676,33 @@ void setup() {
   Serial.begin(115200);
   delay(200);
 
-  pinMode(FLASH_LED_PIN, OUTPUT);
-  set_flash(false);
+  led_init();
   pinMode(BUTTON_PIN, INPUT_PULLUP);
 
   g_boot_ms = millis();
+  int cfg_overrides = cfg_load();
+  log_init();
   log_clear();
 
   log_pushf("=== %s ===", DEVICE_NAME);
   log_pushf("[sys] reset=%s cpu=%uMHz", reset_reason_str(esp_reset_reason()), getCpuFrequencyMhz());
   log_pushf("[sys] heap=%u psram=%s", ESP.getFreeHeap(), psramFound() ? "YES" : "NO");
+  log_pushf("[cfg] %d NVS overrides, log_cap=%d", cfg_overrides, g_log_cap);
 
   log_pushf("[sd] init...");
   g_sd_available = init_sd_card();
 
   setup_camera();
+  start_capture_pipeline();
 
+  g_main_events = xEventGroupCreate();
+  esp_timer_create_args_t status_args = {};
+  status_args.callback = status_timer_cb;
+  status_args.name = "status";
+  esp_timer_create(&status_args, &g_status_timer);
+  esp_timer_start_periodic(g_status_timer, STATUS_PERIOD_MS * 1000ULL);
+  
+  xTaskCreatePinnedToCore(input_task, "input", 6144, NULL, 4, &g_input_task, 1);
   attachInterrupt(digitalPinToInterrupt(BUTTON_PIN), button_isr, CHANGE);
   log_pushf("[btn] GPIO%d ready", BUTTON_PIN);
 
@@ -1376,6 +4710,8 @@ void setup() {
   connect_wifi_dual();
 
   start_webserver();
+  start_rtsp_server();
+  start_udp_push();
 
   if (WiFi.status() == WL_CONNECTED) {
     log_pushf("[url] http://%s/", WiFi.localIP().toString().c_str());
@@ -1385,21 +4721,23 @@ void setup() {
 }
 
 // ============================ LOOP ============================
-void loop() {
-  process_button_events();
-
+static void log_status() {
   uint32_t now = millis();
-  if (now - g_last_status_ms > 5000) {
-    g_last_status_ms = now;
-    log_pushf("[stat] up=%us wifi=%s rssi=%d heap=%u sd=%s eye=%u/%u%s",
-              (now - g_boot_ms) / 1000,
-              WiFi.status() == WL_CONNECTED ? "OK" : "DOWN",
-              WiFi.RSSI(),
-              ESP.getFreeHeap(),
-              g_sd_available ? "OK" : "NO",
-              g_eyetrack_captures, g_eyetrack_triggers,
-              g_is_recording ? " REC" : "");
-  }
-
-  delay(g_is_recording ? 5 : 20);
+  log_pushf("[stat] up=%us wifi=%s rssi=%d heap=%u sd=%s eye=%u/%u q=%d/%d/%d%s",
+            (now - g_boot_ms) / 1000,
+            WiFi.status() == WL_CONNECTED ? "OK" : "DOWN",
+            WiFi.RSSI(),
+            ESP.getFreeHeap(),
+            g_sd_available ? "OK" : "NO",
+            g_eyetrack_captures, g_eyetrack_triggers,
+            aq_quality(AQ_STREAM), aq_quality(AQ_CAPTURE), aq_quality(AQ_RECORD),
+            g_is_recording ? " REC" : "");
+}
+
+void loop() {
+  EventBits_t bits = xEventGroupWaitBits(g_main_events, EV_ALL, pdTRUE, pdFALSE, portMAX_DELAY);
+  
+  if (bits & EV_REC_TOGGLE) button_record_toggle();
+  if (bits & EV_RECORD) process_recording();
+  if (bits & EV_STATUS) log_status();
 }
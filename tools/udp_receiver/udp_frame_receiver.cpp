@@ -0,0 +1,221 @@
+#include "udp_frame_receiver.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace jcm {
+
+namespace {
+
+const uint16_t kMagic = 0x4A43;
+const uint8_t kVersion = 1;
+const int64_t kOffsetWindowUs = 10 * 1000000LL;
+
+// Mirrors UdpFragHeader in main.cpp; all fields in network byte order.
+struct __attribute__((packed)) FragHeader {
+  uint16_t magic;
+  uint8_t version;
+  uint8_t flags;
+  uint32_t frame_seq;
+  uint32_t frame_len;
+  uint32_t frag_offset;
+  uint32_t capture_us;
+  uint32_t send_us;
+  uint16_t frag_index;
+  uint16_t frag_count;
+};
+
+int64_t monotonic_us() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// True if sequence a is newer than b, tolerating wrap-around.
+bool seq_newer(uint32_t a, uint32_t b) { return (int32_t)(a - b) > 0; }
+
+}  // namespace
+
+UdpFrameReceiver::UdpFrameReceiver(int max_age_ms) : max_age_us_(max_age_ms * 1000LL) {}
+
+UdpFrameReceiver::~UdpFrameReceiver() { close(); }
+
+bool UdpFrameReceiver::open(uint16_t port) {
+  close();
+  fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd_ < 0) return false;
+
+  // A whole burst of fragments can arrive before we get scheduled.
+  int rcvbuf = 1 << 20;
+  setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(fd_, (sockaddr*)&addr, sizeof(addr)) != 0) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void UdpFrameReceiver::close() {
+  if (fd_ >= 0) ::close(fd_);
+  fd_ = -1;
+}
+
+bool UdpFrameReceiver::receive(UdpFrame& out, int timeout_ms) {
+  if (fd_ < 0) return false;
+
+  uint8_t pkt[2048];
+  int64_t deadline = monotonic_us() + timeout_ms * 1000LL;
+
+  for (;;) {
+    int64_t now = monotonic_us();
+    expire(now);
+
+    int wait_ms = (int)std::max<int64_t>(0, (deadline - now) / 1000);
+    pollfd pfd = {fd_, POLLIN, 0};
+    if (poll(&pfd, 1, wait_ms) <= 0) return false;
+
+    // Drain everything queued before returning, so a completed frame is
+    // never older than one that is already waiting in the socket.
+    int completed = 0;
+    for (;;) {
+      ssize_t n = recv(fd_, pkt, sizeof(pkt), MSG_DONTWAIT);
+      if (n < 0) break;
+      if (handle_packet(pkt, (size_t)n, monotonic_us(), out)) completed++;
+    }
+    if (completed > 0) {
+      stats_.frames_delivered++;
+      stats_.frames_superseded += completed - 1;
+      return true;
+    }
+  }
+}
+
+bool UdpFrameReceiver::handle_packet(const uint8_t* pkt, size_t len, int64_t now_us, UdpFrame& out) {
+  if (len < sizeof(FragHeader)) {
+    stats_.invalid_packets++;
+    return false;
+  }
+
+  FragHeader h;
+  memcpy(&h, pkt, sizeof(h));
+  uint32_t seq = ntohl(h.frame_seq);
+  uint32_t frame_len = ntohl(h.frame_len);
+  uint32_t offset = ntohl(h.frag_offset);
+  uint16_t index = ntohs(h.frag_index);
+  uint16_t count = ntohs(h.frag_count);
+  size_t chunk = len - sizeof(FragHeader);
+
+  if (ntohs(h.magic) != kMagic || h.version != kVersion || count == 0 || index >= count ||
+      (uint64_t)offset + chunk > frame_len || frame_len > (8u << 20)) {
+    stats_.invalid_packets++;
+    return false;
+  }
+  stats_.fragments++;
+
+  if (have_delivered_ && !seq_newer(seq, last_seq_)) {
+    stats_.late_fragments++;
+    return false;
+  }
+
+  Slot* slot = nullptr;
+  for (Slot& s : slots_) {
+    if (s.used && s.seq == seq) slot = &s;
+  }
+  if (!slot) {
+    // Take a free slot, or evict the oldest partial frame.
+    for (Slot& s : slots_) {
+      if (!s.used) { slot = &s; break; }
+      if (!slot || seq_newer(slot->seq, s.seq)) slot = &s;
+    }
+    if (slot->used) stats_.frames_incomplete++;
+    slot->used = true;
+    slot->seq = seq;
+    slot->frame_len = frame_len;
+    slot->frag_count = count;
+    slot->received = 0;
+    slot->capture_us = ntohl(h.capture_us);
+    slot->send_us = ntohl(h.send_us);
+    slot->first_us = now_us;
+    slot->data.resize(frame_len);
+    slot->have.assign(count, false);
+  } else if (slot->frame_len != frame_len || slot->frag_count != count) {
+    stats_.invalid_packets++;
+    return false;
+  }
+
+  if (slot->have[index]) {
+    stats_.duplicate_fragments++;
+    return false;
+  }
+  slot->have[index] = true;
+  slot->received++;
+  memcpy(slot->data.data() + offset, pkt + sizeof(FragHeader), chunk);
+
+  if (slot->received < slot->frag_count) return false;
+  deliver(*slot, now_us, out);
+  return true;
+}
+
+void UdpFrameReceiver::deliver(Slot& slot, int64_t now_us, UdpFrame& out) {
+  if (have_delivered_) stats_.frames_lost += (uint32_t)(slot.seq - last_seq_ - 1);
+  have_delivered_ = true;
+  last_seq_ = slot.seq;
+
+  // Anything older than the frame just completed is now stale.
+  for (Slot& s : slots_) {
+    if (s.used && &s != &slot && !seq_newer(s.seq, slot.seq)) {
+      s.used = false;
+      stats_.frames_incomplete++;
+    }
+  }
+
+  int64_t send_dev = unwrap_device_us(slot.send_us);
+  int64_t offset = now_us - send_dev;
+  if (now_us - window_start_us_ > kOffsetWindowUs) {
+    min_offset_prev_ = min_offset_cur_;
+    min_offset_cur_ = INT64_MAX;
+    window_start_us_ = now_us;
+  }
+  min_offset_cur_ = std::min(min_offset_cur_, offset);
+
+  out.seq = slot.seq;
+  out.jpeg.swap(slot.data);
+  out.capture_us = slot.capture_us;
+  out.recv_us = now_us;
+  out.assembly_us = now_us - slot.first_us;
+  out.device_us = (uint32_t)(slot.send_us - slot.capture_us);
+  out.transit_us = offset - std::min(min_offset_cur_, min_offset_prev_);
+  slot.used = false;
+}
+
+void UdpFrameReceiver::expire(int64_t now_us) {
+  for (Slot& s : slots_) {
+    if (s.used && now_us - s.first_us > max_age_us_) {
+      s.used = false;
+      stats_.frames_incomplete++;
+    }
+  }
+}
+
+int64_t UdpFrameReceiver::unwrap_device_us(uint32_t us) {
+  if (have_device_time_ && us < last_device_us_ && last_device_us_ - us > 0x80000000u) {
+    device_high_ += 1LL << 32;
+  }
+  have_device_time_ = true;
+  last_device_us_ = us;
+  return device_high_ + us;
+}
+
+}  // namespace jcm
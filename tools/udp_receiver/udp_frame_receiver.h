@@ -0,0 +1,108 @@
+/**
+ * udp_frame_receiver — host-side reassembly for the ESP32 UDP frame push
+ *
+ * Receives the datagrams sent by udp_push_task() in main.cpp (enable with
+ * GET /udp/push?host=<this machine>&port=5005), reassembles JPEG frames and
+ * drops anything incomplete or older than the newest delivered frame.
+ *
+ * LATENCY:
+ * Device and host clocks are not synchronised, so the absolute one-way delay
+ * cannot be measured. Each frame reports:
+ * - device_us:  capture -> first fragment sent (device clock only)
+ * - transit_us: network delay above the fastest frame seen in the last ~10 s
+ * Their sum is the glass-to-host latency minus the (unknown, constant) best-case
+ * network delay — the part that can be tuned.
+ *
+ * Linux only (POSIX sockets). Build with the rest of your program, e.g.
+ *   g++ -std=c++17 -O2 udp_rx_example.cpp udp_frame_receiver.cpp -o udp_rx
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace jcm {
+
+struct UdpFrame {
+  uint32_t seq = 0;
+  std::vector<uint8_t> jpeg;
+  uint32_t capture_us = 0;      // device clock
+  int64_t recv_us = 0;          // host CLOCK_MONOTONIC, last fragment
+  int64_t assembly_us = 0;      // first fragment -> last fragment on the host
+  int64_t device_us = 0;        // capture -> send on the device
+  int64_t transit_us = 0;       // one-way delay above the best recently observed
+};
+
+struct UdpReceiverStats {
+  uint64_t fragments = 0;
+  uint64_t duplicate_fragments = 0;
+  uint64_t late_fragments = 0;      // belonged to a frame older than the last delivered
+  uint64_t invalid_packets = 0;
+  uint64_t frames_delivered = 0;
+  uint64_t frames_superseded = 0;   // completed, but a newer one completed in the same read
+  uint64_t frames_incomplete = 0;   // partially received, then dropped
+  uint64_t frames_lost = 0;         // sequence gaps, incomplete or never seen
+};
+
+class UdpFrameReceiver {
+ public:
+  // Incomplete frames are dropped after max_age_ms or as soon as a newer
+  // frame completes.
+  explicit UdpFrameReceiver(int max_age_ms = 200);
+  ~UdpFrameReceiver();
+
+  UdpFrameReceiver(const UdpFrameReceiver&) = delete;
+  UdpFrameReceiver& operator=(const UdpFrameReceiver&) = delete;
+
+  bool open(uint16_t port);
+  void close();
+
+  // Blocks for up to timeout_ms. Returns true with the newest complete frame
+  // in `out`; older frames that completed in the same read are skipped.
+  bool receive(UdpFrame& out, int timeout_ms);
+
+  const UdpReceiverStats& stats() const { return stats_; }
+
+ private:
+  struct Slot {
+    bool used = false;
+    uint32_t seq = 0;
+    uint32_t frame_len = 0;
+    uint16_t frag_count = 0;
+    uint16_t received = 0;
+    uint32_t capture_us = 0;
+    uint32_t send_us = 0;
+    int64_t first_us = 0;
+    std::vector<uint8_t> data;
+    std::vector<bool> have;
+  };
+
+  static const int kSlots = 4;
+
+  bool handle_packet(const uint8_t* pkt, size_t len, int64_t now_us, UdpFrame& out);
+  void deliver(Slot& slot, int64_t now_us, UdpFrame& out);
+  void expire(int64_t now_us);
+  int64_t unwrap_device_us(uint32_t us);
+
+  int fd_ = -1;
+  int64_t max_age_us_;
+  Slot slots_[kSlots];
+  bool have_delivered_ = false;
+  uint32_t last_seq_ = 0;
+
+  // 32-bit device microseconds extended to 64 bits
+  bool have_device_time_ = false;
+  uint32_t last_device_us_ = 0;
+  int64_t device_high_ = 0;
+
+  // windowed minimum of (host recv - device send)
+  int64_t min_offset_cur_ = INT64_MAX;
+  int64_t min_offset_prev_ = INT64_MAX;
+  int64_t window_start_us_ = 0;
+
+  UdpReceiverStats stats_;
+};
+
+}  // namespace jcm
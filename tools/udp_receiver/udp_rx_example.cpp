@@ -0,0 +1,60 @@
+// Minimal consumer: prints per-second rate, loss and latency, and keeps the
+// newest frame in latest.jpg.
+//   ./udp_rx [port]
+
+#include "udp_frame_receiver.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+
+static double now_s() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+  uint16_t port = argc > 1 ? (uint16_t)atoi(argv[1]) : 5005;
+
+  jcm::UdpFrameReceiver rx;
+  if (!rx.open(port)) {
+    perror("bind");
+    return 1;
+  }
+  printf("listening on udp/%u\n", port);
+
+  jcm::UdpFrame frame;
+  double window_start = now_s();
+  int frames = 0;
+  int64_t device_sum = 0, transit_sum = 0, transit_max = 0;
+
+  for (;;) {
+    if (rx.receive(frame, 1000)) {
+      frames++;
+      device_sum += frame.device_us;
+      transit_sum += frame.transit_us;
+      if (frame.transit_us > transit_max) transit_max = frame.transit_us;
+
+      if (FILE* f = fopen("latest.jpg", "wb")) {
+        fwrite(frame.jpeg.data(), 1, frame.jpeg.size(), f);
+        fclose(f);
+      }
+    }
+
+    double t = now_s();
+    if (t - window_start >= 1.0) {
+      const jcm::UdpReceiverStats& s = rx.stats();
+      printf("%.1f fps  device %.1f ms  transit avg %.1f / max %.1f ms  lost %llu  incomplete %llu  superseded %llu\n",
+             frames / (t - window_start),
+             frames ? device_sum / 1000.0 / frames : 0.0,
+             frames ? transit_sum / 1000.0 / frames : 0.0,
+             transit_max / 1000.0,
+             (unsigned long long)s.frames_lost, (unsigned long long)s.frames_incomplete,
+             (unsigned long long)s.frames_superseded);
+      window_start = t;
+      frames = 0;
+      device_sum = transit_sum = transit_max = 0;
+    }
+  }
+}